@@ -12,6 +12,7 @@
 #  ...
 #
 #  CLANG_LIBS                  - All the Clang C++ libraries
+#  CLANG_TOOL_LIBS             - Static Clang C++ libraries needed by tooling, in link order
 #
 # Uses the same include and library paths detected by FindLLVM.cmake
 #
@@ -57,6 +58,7 @@ if (LLVM_FOUND AND LLVM_LIBRARY_DIRS)
   # note: On Windows there's 'libclang.dll' instead of 'clang.dll' -> search for 'libclang', too
   find_library(CLANG_LIBCLANG_LIB NAMES clang libclang HINTS ${LLVM_LIBRARY_DIRS}) # LibClang: high-level C interface
 
+  FIND_AND_ADD_CLANG_LIB(clangIndex)
   FIND_AND_ADD_CLANG_LIB(clangFrontend)
   FIND_AND_ADD_CLANG_LIB(clangDriver)
   FIND_AND_ADD_CLANG_LIB(clangCodeGen)
@@ -80,6 +82,33 @@ if (LLVM_FOUND AND LLVM_LIBRARY_DIRS)
   FIND_AND_ADD_CLANG_LIB(clangStaticAnalyzerFrontend)
   FIND_AND_ADD_CLANG_LIB(clangSema)
   FIND_AND_ADD_CLANG_LIB(clangRewriteCore)
+
+  macro(FIND_AND_ADD_CLANG_TOOL_LIB _libname_)
+    string(TOUPPER ${_libname_} _prettylibname_)
+    find_library(CLANG_${_prettylibname_}_STATIC_LIB NAMES ${CMAKE_STATIC_LIBRARY_PREFIX}${_libname_}${CMAKE_STATIC_LIBRARY_SUFFIX} HINTS ${LLVM_LIBRARY_DIRS})
+    if(CLANG_${_prettylibname_}_STATIC_LIB)
+      set(CLANG_TOOL_LIBS ${CLANG_TOOL_LIBS} ${CLANG_${_prettylibname_}_STATIC_LIB})
+    endif()
+  endmacro(FIND_AND_ADD_CLANG_TOOL_LIB)
+
+  # Every library comes before the ones it depends on, following the LINK_LIBS of lib/*/CMakeLists.txt in Clang 4.0,
+  # the only version the tool builds with. Some of them still depend on each other, see the link group in CMakeLists.txt
+  FIND_AND_ADD_CLANG_TOOL_LIB(clangIndex)
+  FIND_AND_ADD_CLANG_TOOL_LIB(clangTooling)
+  FIND_AND_ADD_CLANG_TOOL_LIB(clangASTMatchers)
+  FIND_AND_ADD_CLANG_TOOL_LIB(clangFrontend)
+  FIND_AND_ADD_CLANG_TOOL_LIB(clangDriver)
+  FIND_AND_ADD_CLANG_TOOL_LIB(clangFormat)
+  FIND_AND_ADD_CLANG_TOOL_LIB(clangToolingCore)
+  FIND_AND_ADD_CLANG_TOOL_LIB(clangRewrite)
+  FIND_AND_ADD_CLANG_TOOL_LIB(clangSerialization)
+  FIND_AND_ADD_CLANG_TOOL_LIB(clangParse)
+  FIND_AND_ADD_CLANG_TOOL_LIB(clangSema)
+  FIND_AND_ADD_CLANG_TOOL_LIB(clangAnalysis)
+  FIND_AND_ADD_CLANG_TOOL_LIB(clangEdit)
+  FIND_AND_ADD_CLANG_TOOL_LIB(clangAST)
+  FIND_AND_ADD_CLANG_TOOL_LIB(clangLex)
+  FIND_AND_ADD_CLANG_TOOL_LIB(clangBasic)
 endif()
 
 if(CLANG_LIBS OR CLANG_LIBCLANG_LIB)
@@ -110,6 +139,7 @@ if(CLANG_FOUND)
   message(STATUS "Found Clang (LLVM version: ${LLVM_VERSION})")
   message(STATUS "  Include dirs:       ${CLANG_INCLUDE_DIRS}")
   message(STATUS "  Clang libraries:    ${CLANG_LIBS}")
+  message(STATUS "  Tooling libraries:  ${CLANG_TOOL_LIBS}")
   message(STATUS "  Libclang C library: ${CLANG_LIBCLANG_LIB}")
 else()
   if(Clang_FIND_REQUIRED)
@@ -6,6 +6,8 @@
 #  LLVM_CFLAGS         - llvm compiler flags
 #  LLVM_LFLAGS         - llvm linker flags
 #  LLVM_MODULE_LIBS    - list of llvm libs for working with modules.
+#  LLVM_TOOL_LIBS      - static llvm libs needed by Clang tooling, and nothing else
+#  LLVM_SYSTEM_LIBS    - system libs the llvm libs depend on
 #  LLVM_INSTALL_PREFIX - LLVM installation prefix
 #  LLVM_FOUND          - True if llvm found.
 #  LLVM_VERSION        - Version string ("llvm-config --version")
@@ -111,6 +113,23 @@ if (LLVM_FOUND)
     OUTPUT_STRIP_TRAILING_WHITESPACE
   )
 
+  # --link-static is only known since 3.9, older versions list the static libs anyway
+  if (NOT ${LLVM_VERSION} VERSION_LESS "3.9.0")
+    set(_llvmLinkStatic --link-static)
+  endif()
+
+  execute_process(
+    COMMAND ${LLVM_CONFIG_EXECUTABLE} ${_llvmLinkStatic} --libfiles option mcparser mc bitreader profiledata core support
+    OUTPUT_VARIABLE LLVM_TOOL_LIBS
+    OUTPUT_STRIP_TRAILING_WHITESPACE
+  )
+
+  execute_process(
+    COMMAND ${LLVM_CONFIG_EXECUTABLE} ${_llvmLinkStatic} --system-libs
+    OUTPUT_VARIABLE LLVM_SYSTEM_LIBS
+    OUTPUT_STRIP_TRAILING_WHITESPACE
+  )
+
   execute_process(
     COMMAND ${LLVM_CONFIG_EXECUTABLE} --prefix
     OUTPUT_VARIABLE LLVM_INSTALL_PREFIX
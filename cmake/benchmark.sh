@@ -0,0 +1,57 @@
+#!/usr/bin/env bash
+#
+# Measures how long the tool takes to start, and to generate the categories of a project
+#
+# Usage: benchmark.sh <composition_tool> <output directory> <project directory> [compiler arguments...]
+#
+# Every .m file of the project is a source. The number of runs of each measure can be changed
+# with the STARTUP_RUNS and PROJECT_RUNS environment variables.
+
+set -e
+
+if [ $# -lt 3 ]; then
+  echo "Usage: $0 <composition_tool> <output directory> <project directory> [compiler arguments...]" >&2
+  exit 1
+fi
+
+tool="$1"
+outputDirectory="$2"
+projectDirectory="$3"
+shift 3
+
+startupRuns="${STARTUP_RUNS:-100}"
+projectRuns="${PROJECT_RUNS:-10}"
+
+mkdir -p "$outputDirectory"
+
+sources=("$projectDirectory"/*.m)
+
+# Prints the average wall time of running a command several times, in milliseconds
+measure() {
+  local runs="$1"
+  shift
+
+  local TIMEFORMAT=%R
+  local seconds
+
+  seconds=$( { time (for ((i = 0; i < runs; i++)); do "$@" > /dev/null 2>&1 || true; done) ; } 2>&1 )
+
+  awk -v seconds="$seconds" -v runs="$runs" 'BEGIN { printf "%.2f ms\n", seconds * 1000 / runs }'
+}
+
+echo "Tool: $tool ($(wc -c < "$tool" | tr -d ' ') bytes)"
+
+# -version exits right after the command line is parsed, so only loading the tool is left
+echo "Startup, average of $startupRuns runs: $(measure "$startupRuns" "$tool" -version)"
+
+projectCommand=("$tool"
+  -header-file="$outputDirectory/Generated.h"
+  -implementation-file="$outputDirectory/Generated.m"
+  "${sources[@]}" -- -x objective-c -fobjc-arc -I"$projectDirectory" "$@")
+
+# A run failing early, e.g. not finding Foundation, would only measure how fast it fails
+if ! "${projectCommand[@]}" > "$outputDirectory/project.log" 2>&1; then
+  echo "warning: the tool failed on the project, see $outputDirectory/project.log" >&2
+fi
+
+echo "Project with ${#sources[@]} sources, average of $projectRuns runs: $(measure "$projectRuns" "${projectCommand[@]}")"
@@ -10,6 +10,11 @@
  * and self-contained function.
 */
 
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <mutex>
+#include <set>
 #include <sstream>
 #include <string>
 
@@ -19,11 +24,17 @@
 #include <clang/Frontend/ASTConsumers.h>
 #include <clang/Frontend/CompilerInstance.h>
 #include <clang/Frontend/FrontendActions.h>
+#include <clang/Frontend/Utils.h>
+#include <clang/Index/USRGeneration.h>
 #include <clang/Rewrite/Core/Rewriter.h>
 #include <clang/Tooling/CommonOptionsParser.h>
 #include <clang/Tooling/Tooling.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Support/FormatVariadic.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Process.h>
 #include <clang/Lex/Lexer.h>
 
 namespace {
@@ -33,6 +44,10 @@ namespace {
   
   const auto objCCategoryImplementationFormatBegin = "@implementation {0} ({1}__{2})\n\n";
   
+  const auto objCCoalescedCategoryHeaderFormatBegin = "@interface {0} (CompositionTool)\n\n";
+  
+  const auto objCCoalescedCategoryImplementationFormatBegin = "@implementation {0} (CompositionTool)\n\n";
+  
   const auto objcDeclarationEnd = "@end\n\n";
 
   const auto objCSelectorImplementationFormat = R"+-+(
@@ -47,17 +62,196 @@ namespace {
   const auto objCSelectorSignatureFormat = R"+=+({0} ({1}){2})+=+";
   
   const auto objCIncludeFileFormat = "#include \"{0}\"\n";
+  
+  // Literal braces are escaped as "{{" in all the formats below
+  const auto objCLazyMethodFunctionNameFormat = "__composition_tool_{0}_{1}__{2}_{3}_{4}";
+  
+  // {0} is the whole declarator, as the return type might have to wrap the name and parameters
+  const auto objCLazyMethodFunctionFormat = R"+-+(
+static {0} {{
+  return [{1} {2}];
+}
+)+-+";
+  
+  const auto objCLazyMethodFunctionDeclaratorFormat = "{0}({1} self, SEL _cmd{2})";
+  
+  const auto objCLazyMethodParameterFormat = ", {0}";
+  
+  // Lazy forwarders are C functions, which ARC assumes to return +0 and not to consume their arguments
+  const auto objCReturnsRetainedAttribute = "__attribute__((ns_returns_retained)) ";
+  
+  const auto objCConsumedAttribute = "__attribute__((ns_consumed)) ";
+  
+  const auto objCSharedForwarderNameFormat = "__composition_tool_shared_{0}";
+  
+  // Reads the component with the accessor of the host it is installed on, the block's code being shared by all of them
+  // The typedef {1} names the return type {2}, as a block literal cannot spell out e.g. a block return type
+  // The accessor has a reserved name, as a parameter of the method with the same name would hide it in the block
+  const auto objCSharedForwarderFactoryFormat = R"+-+(
+static IMP {0}(SEL __composition_tool_accessor) {{
+  typedef {1};
+  return imp_implementationWithBlock(^{2}(id self{3}) {{
+    return [(({4})objc_msgSend)(self, __composition_tool_accessor) {5}];
+  });
+}
+)+-+";
+  
+  const auto objCSharedForwarderResultTypeFormat = "{0}_result";
+  
+  // The installer looks selectors up in tables sorted by the tool, so nothing is done at load time
+  const auto objCLazyMethodRuntimeSupport = R"+-+(#include <objc/message.h>
+#include <objc/runtime.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  const char* selector;
+  IMP implementation;
+  IMP (*factory)(SEL accessor);
+  const char* accessor;
+  const char* types;
+} __CompositionToolMethod;
+
+static int __composition_tool_compare_method(const void* selector, const void* method) {
+  return strcmp((const char*)selector, ((const __CompositionToolMethod*)method)->selector);
+}
+
+static BOOL __composition_tool_install_method(Class cls, SEL selector, const __CompositionToolMethod* methods, size_t count) {
+  const __CompositionToolMethod* method = bsearch(sel_getName(selector), methods, count, sizeof(*methods), __composition_tool_compare_method);
+  
+  if (method == NULL) {
+    return NO;
+  }
+  
+  IMP implementation = method->factory != NULL ? method->factory(sel_registerName(method->accessor)) : method->implementation;
+  return class_addMethod(cls, selector, implementation, method->types);
+}
+
+)+-+";
+  
+  const auto objCLazyMethodTableNameFormat = "__composition_tool_{0}_{1}_methods";
+  
+  const auto objCLazyMethodTableBeginFormat = "static const __CompositionToolMethod {0}[] = {{\n";
+  
+  const auto objCLazyMethodTableEntryFormat = "  {{\"{0}\", (IMP){1}, NULL, NULL, \"{2}\"},\n";
+  
+  const auto objCSharedLazyMethodTableEntryFormat = "  {{\"{0}\", NULL, {1}, \"{2}\", \"{3}\"},\n";
+  
+  // Keeps the table valid C when all the other entries are compiled out, "~" sorting after any selector
+  const auto objCLazyMethodTableEnd = "  {\"~\", NULL, NULL, NULL, NULL},\n};\n\n";
+  
+  const auto objCLazyMethodResolverBeginFormat = "@implementation {0} (CompositionToolLazyMethods)\n";
+  
+  const auto objCLazyInstanceMethodResolverFormat = R"+-+(
++ (BOOL)resolveInstanceMethod:(SEL)selector {{
+  return __composition_tool_install_method([{0} class], selector, {1}, sizeof({1}) / sizeof(*{1}) - 1) || [super resolveInstanceMethod:selector];
+}
+)+-+";
+  
+  const auto objCLazyClassMethodResolverFormat = R"+-+(
++ (BOOL)resolveClassMethod:(SEL)selector {{
+  return __composition_tool_install_method(object_getClass([{0} class]), selector, {1}, sizeof({1}) / sizeof(*{1}) - 1) || [super resolveClassMethod:selector];
+}
+)+-+";
+  
+  const auto objCCategoryCommentFormat = "// {0} ({1}__{2})\n";
+  
+  const auto objCConditionBeginFormat = "#if {0}\n";
+  
+  const auto objCConditionEnd = "#endif\n";
+  
+  const auto objCImportFileFormat = "#import \"{0}\"\n";
+  
+  const auto umbrellaFilenameFormat = "composition_tool_umbrella_{0}.m";
+  
+  const auto moduleCachePathArgumentFormat = "-fmodules-cache-path={0}";
+  
+  // Must change whenever the layout of cache entries or of the generated categories does
+  const auto cacheFormatVersion = "composition-tool-cache-8";
+  
+  const auto manifestFormatVersion = "composition-tool-manifest-6";
+  
+  const auto cacheEntryFilenameFormat = "{0}.entry";
+  
+  // Remembers the hash of a tool binary, keyed by its path, size and modification time
+  const auto cacheToolIdentityFilenameFormat = "{0}.tool";
+  
+  const auto cacheTemporaryFilenameModel = "%%%%%%%%%%%%.tmp";
+
+  auto formatSelectorKey(bool isClassMethod, llvm::StringRef selector) -> std::string
+  {
+    return (isClassMethod ? "+" : "-") + selector.str();
+  }
+
+  // Selectors sent anywhere in the project, keyed as in PROVIDE(): "-selector" or "+selector"
+  struct SelectorUsage
+  {
+    // Messages whose receiver class is not statically known (id, Class, @selector(...), etc.)
+    std::set<std::string> anyReceiver;
+    std::map<std::string, std::set<std::string>> byReceiver;
+    std::map<std::string, std::string> superClasses;
+
+    auto isAncestor(llvm::StringRef ancestor, llvm::StringRef interface) const -> bool
+    {
+      for (auto it = superClasses.find(interface); it != superClasses.end(); it = superClasses.find(it->second)) {
+        if (it->second == ancestor) {
+          return true;
+        }
+      }
+
+      return false;
+    }
+
+    // A message sent to a superclass or subclass of the host might reach it at runtime, too
+    auto isUsed(llvm::StringRef hostName, const std::string& selectorKey) const -> bool
+    {
+      if (anyReceiver.count(selectorKey) > 0) {
+        return true;
+      }
+
+      for (const auto& receiver: byReceiver) {
+        if (receiver.second.count(selectorKey) == 0) {
+          continue;
+        }
+
+        if (receiver.first == hostName || isAncestor(receiver.first, hostName) || isAncestor(hostName, receiver.first)) {
+          return true;
+        }
+      }
+
+      return false;
+    }
+  };
+
+  // A forwarder generated as a C function, installed on its host class by the runtime the first time it is needed
+  struct LazyMethod
+  {
+    bool isClassMethod;
+    std::string selector;
+    std::string functionName;
+    std::string typeEncoding;
+    // When set, functionName is a factory of the implementation, shared with other hosts and reading the component with this selector
+    std::string accessor;
+    // Definition of a function shared with other categories, written only once
+    std::string sharedDefinition;
+  };
 
   struct CodeGeneratorContext
   {
     CodeGeneratorContext(clang::CompilerInstance* compilerInstance,
                          llvm::StringRef inputFilename,
                          llvm::raw_ostream& headerStream,
-                         llvm::raw_ostream& implStream):
+                         llvm::raw_ostream& implStream,
+                         const SelectorUsage* selectorUsage = nullptr,
+                         std::vector<LazyMethod>* lazyMethods = nullptr,
+                         std::vector<std::string>* selectorKeys = nullptr):
       compilerInstance(compilerInstance),
       inputFilename(inputFilename),
       headerStream(headerStream),
-      implStream(implStream)
+      implStream(implStream),
+      selectorUsage(selectorUsage),
+      lazyMethods(lazyMethods),
+      selectorKeys(selectorKeys)
     {
     }
     
@@ -65,765 +259,3259 @@ namespace {
     llvm::StringRef inputFilename;
     llvm::raw_ostream& headerStream;
     llvm::raw_ostream& implStream;
+    
+    // When set, forwarders never called on their host classes are not generated
+    const SelectorUsage* selectorUsage;
+    
+    // When set, forwarders are generated as C functions instead of methods
+    std::vector<LazyMethod>* lazyMethods;
+    
+    // When set, receives the key of every generated forwarder, to find members provided twice to a host
+    std::vector<std::string>* selectorKeys;
+    
+    // Lazy forwarders identical but for the component they read are generated only once
+    bool shareForwarders = false;
   };
 
-  struct KnownDeclarations
-  {
-    template<typename T>
-    using LookupByInterfaceName = std::map<llvm::StringRef, T>;
-
-    LookupByInterfaceName<clang::ObjCInterfaceDecl*> interfaces;
-    LookupByInterfaceName<clang::ObjCInterfaceDecl*> parent;
-  };
-
-  template<typename F, typename D>
-  auto runIfInMainFile(clang::ASTContext& context, F function, D decl) -> bool
-  {
-    if (context.getSourceManager().isInMainFile(decl->getLocStart())) {
-      return function(decl);
-    }
-    
-    return true;
-  }
-  
-  enum struct ProvidedItemType
+  // The members of an `@interface Host (Type__property)` category and of its `@implementation`
+  struct GeneratedCategory
   {
-    InstanceMethod,
-    ClassMethod,
-    Property,
-    Unknown,
+    std::string usr;
+    // Of the declarations the category was generated from
+    std::string semanticHash;
+    std::string hostName;
+    std::string typeName;
+    std::string propertyName;
+    // Location of the PROVIDE annotation, where errors in the generated code are reported
+    std::string origin;
+    std::string header;
+    std::string implementation;
+    std::vector<LazyMethod> lazyMethods;
+    // formatSelectorKey() of each forwarder, sorted
+    std::vector<std::string> selectorKeys;
+    // Preprocessor condition guarding the category in the output, only set when merging configurations
+    std::string condition;
+    // Indexes of the configurations generating the category, along with condition, sorted. Empty when in all of them
+    std::vector<size_t> configurations;
   };
   
-  struct ProvidedItem
+  // What a translation unit needs, regardless of which one actually generated each category
+  struct TranslationUnitRecord
   {
-    ProvidedItemType type;
-    llvm::StringRef value;
+    std::vector<std::string> categoryUSRs;
+    std::vector<std::string> dependencies;
+    bool hasErrors = false;
   };
   
-  auto extractProvidedItems(const std::vector<clang::AnnotateAttr*>& attrs) -> std::vector<ProvidedItem>
+  // Shared by all the translation units of a run, which may be processed in parallel,
+  // so that a category declared in a header is generated once, no matter how many files import it
+  struct GeneratedCategoryRegistry
   {
-    auto splitList = llvm::SmallVector<llvm::StringRef, 10>();
+    // Returns false if the category was already claimed by some translation unit
+    auto claim(const std::string& translationUnit, const std::string& usr) -> bool
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      translationUnits[translationUnit].categoryUSRs.push_back(usr);
+      return claimedUSRs.emplace(usr, translationUnit).second;
+    }
     
-    // TODO: handle errors on parsing provided items?
-    for (const auto attr: attrs) {
-      attr->getAnnotation().trim().substr(PROVIDE_TAG.size()).split(splitList, " ", -1, false);
+    auto add(GeneratedCategory category) -> void
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      categories[category.usr] = std::move(category);
     }
     
-    auto items = std::vector<ProvidedItem>{splitList.size()};
+    auto finish(const std::string& translationUnit, std::vector<std::string> dependencies, bool hasErrors) -> void
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      auto& record = translationUnits[translationUnit];
+      record.dependencies = std::move(dependencies);
+      record.hasErrors = hasErrors;
+    }
     
-    std::transform(std::begin(splitList), std::end(splitList), begin(items), [](StringRef s) -> ProvidedItem {
-      assert(s.size() > 0);
-      
-      const auto type = [=]() -> ProvidedItemType {
-        switch(s[0]) {
-          case '@': return ProvidedItemType::Property;
-          case '-': return ProvidedItemType::InstanceMethod;
-          case '+': return ProvidedItemType::ClassMethod;
-        }
-        
-        assert(false && "Invalid Type!!!! FIXME: handle error");
-        
-        return ProvidedItemType::Unknown;
-      }();
+    // Forgets a translation unit and the categories it provided, so that its files can be parsed again
+    auto discard(const std::string& translationUnit) -> void
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      const auto record = translationUnits.find(translationUnit);
       
-      const auto value = s.substr(1);
+      if (record == translationUnits.end()) {
+        return;
+      }
       
-      assert(value.size() > 0 && "Invalid Value!!! FIXME: handle error");
+      for (const auto& usr: record->second.categoryUSRs) {
+        const auto owner = claimedUSRs.find(usr);
+        
+        if (owner != claimedUSRs.end() && owner->second == translationUnit) {
+          claimedUSRs.erase(owner);
+          categories.erase(usr);
+        }
+      }
       
-      return {type, value};
-    });
+      translationUnits.erase(record);
+    }
     
-    return items;
-  }
-  
-  template<typename NodeType>
-  auto getParent(const CodeGeneratorContext& context, const NodeType o) -> const clang::ObjCContainerDecl*
+    // Ready for another configuration
+    auto clear() -> void
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      claimedUSRs.clear();
+      categories.clear();
+      translationUnits.clear();
+    }
+    
+    std::mutex mutex;
+    // The translation unit which claimed each category
+    std::map<std::string, std::string> claimedUSRs;
+    // Sorted by USR, so the output does not depend on the order translation units finish in
+    std::map<std::string, GeneratedCategory> categories;
+    std::map<std::string, TranslationUnitRecord> translationUnits;
+  };
+
+  // Hashes of everything (but the dependencies) which can change what a translation unit generates
+  auto hashString(llvm::StringRef string) -> std::string
   {
-    assert(o != nullptr);
+    auto hash = llvm::MD5{};
+    hash.update(string);
     
-    auto& astContext = context.compilerInstance->getASTContext();
+    auto result = llvm::MD5::MD5Result{};
+    hash.final(result);
     
-    for (const auto p: astContext.getParents(*o)) {
-        const auto parent = p.template get<clang::ObjCContainerDecl>();
-        
-        if (parent != nullptr) {
-          return parent;
-        }
-      }
-      
-      return nullptr;
+    auto hexResult = llvm::SmallString<32>{};
+    llvm::MD5::stringifyResult(result, hexResult);
+    
+    return hexResult.str();
   }
   
-  template<typename NodeType>
-  auto getInterfaceForMember(const CodeGeneratorContext& context, const NodeType member) -> const clang::ObjCInterfaceDecl*
+  // An empty hash means the file could not be read, which never matches a previous one. Translation units share
+  // most of their headers, so each file is only read and hashed once per run.
+  auto hashFile(llvm::StringRef path) -> std::string
   {
-    const auto parent = getParent(context, member);
-    
-    assert(parent != nullptr);
+    static std::mutex mutex;
+    static auto hashes = std::map<std::string, std::string>{};
     
-    if (const auto interface = llvm::dyn_cast<clang::ObjCInterfaceDecl>(parent)) {
-      return interface;
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      const auto it = hashes.find(path.str());
+      
+      if (it != hashes.end()) {
+        return it->second;
+      }
     }
     
-    if (const auto category = llvm::dyn_cast<clang::ObjCCategoryDecl>(parent)) {
-      return category->getClassInterface();
-    }
+    const auto buffer = llvm::MemoryBuffer::getFile(path);
+    const auto hash = buffer ? hashString((*buffer)->getBuffer()) : std::string{};
     
-    return nullptr;
+    std::lock_guard<std::mutex> lock{mutex};
+    hashes[path.str()] = hash;
+    
+    return hash;
   }
   
-  template<
-    typename Result,
-    typename Filter,
-    typename ProtocolExtractor>
-  auto getMemberForProtocols(llvm::iterator_range<clang::ObjCProtocolDecl*const*> protocols, Filter filter, ProtocolExtractor protocolExtractor) -> Result
+  // Like ccache's base_dir, paths under the base directory are relative to it, so that checkouts in different
+  // directories (e.g. of several CI workers) share cache entries
+  auto makeRelativeToBaseDirectory(llvm::StringRef path, llvm::StringRef baseDirectory) -> std::string
   {
-    for (const auto protocol: protocols) {
-      llvm::outs() << "checking member in protocol " << protocol->getName() << '\n';
-      const auto membersInProtocol = protocolExtractor(protocol);
-      
-      const auto it = std::find_if(std::begin(membersInProtocol), std::end(membersInProtocol), filter);
-      
-      if (it != std::end(membersInProtocol)) {
-        return *it;
-      }
+    if (baseDirectory.empty() || !path.startswith(baseDirectory)) {
+      return path;
     }
     
-    // Depth first search on referenced protocols tree!
-    for (const auto protocol: protocols) {
-      llvm::outs() << "entering recursively in " << protocol->getName() << '\n';
-      const auto referencedProtocols = protocol->protocols();
-      const auto memberInReferencedProtocol = getMemberForProtocols<Result>(referencedProtocols, filter, protocolExtractor);
-      
-      if (memberInReferencedProtocol != Result()) {
-        return memberInReferencedProtocol;
-      }
+    const auto rest = path.drop_front(baseDirectory.size());
+    
+    if (rest.empty()) {
+      return ".";
     }
     
-    return Result();
+    return llvm::sys::path::is_separator(rest.front()) ? rest.drop_front().str() : path.str();
   }
   
-  // FIXME: this method is way too big! Split it in small pieces!
-  template<
-    typename Result,
-    typename Filter,
-    typename InterfaceExtractor,
-    typename CategoryExtractor, 
-    typename ProtocolExtractor>
-  auto getMemberForObjectInterfaceType(const clang::ObjCInterfaceType* interfaceType,
-                       Filter filter,
-                       InterfaceExtractor interfaceExtractor,
-                       CategoryExtractor categoryExtractor,
-                       ProtocolExtractor protocolExtractor) -> Result
+  auto makeAbsoluteFromBaseDirectory(llvm::StringRef path, llvm::StringRef baseDirectory) -> std::string
   {
-    const auto propertyInterfaceDecl = interfaceType->getDecl();
-    const auto categories = propertyInterfaceDecl->known_categories();
-    const auto membersInInterface = interfaceExtractor(propertyInterfaceDecl);
+    if (baseDirectory.empty() || llvm::sys::path::is_absolute(path)) {
+      return path;
+    }
     
-    // FIXME: there's no need for building the list of pairs!
-    auto pairs = std::vector<std::pair<decltype(membersInInterface.begin()), decltype(membersInInterface.end())>>{};
-    pairs.emplace_back(membersInInterface.begin(), membersInInterface.end());
+    auto absolutePath = llvm::SmallString<256>{baseDirectory};
+    llvm::sys::path::append(absolutePath, path);
     
-    for (const auto& category: categories) {
-      const auto membersInCategory = categoryExtractor(category);
-      pairs.emplace_back(membersInCategory.begin(), membersInCategory.end());
+    return absolutePath.str();
+  }
+  
+  // Also rewrites paths joined to an option, like -I/path/to/headers
+  auto makeArgumentRelativeToBaseDirectory(llvm::StringRef argument, llvm::StringRef baseDirectory) -> std::string
+  {
+    const auto position = baseDirectory.empty() ? llvm::StringRef::npos : argument.find(baseDirectory);
+    
+    if (position == llvm::StringRef::npos || (position > 0 && !argument.startswith("-"))) {
+      return argument;
     }
     
-    for (const auto pairIt: pairs) {
-      const auto it = std::find_if(pairIt.first, pairIt.second, filter);
+    return argument.substr(0, position).str() + makeRelativeToBaseDirectory(argument.drop_front(position), baseDirectory);
+  }
   
-      if (it != pairIt.second) {
-        return *it;
+  auto computeTranslationUnitKey(llvm::StringRef baseKey,
+                                 const std::vector<clang::tooling::CompileCommand>& commands,
+                                 llvm::StringRef mainFileContents,
+                                 llvm::StringRef baseDirectory) -> std::string
+  {
+    auto key = baseKey.str();
+    
+    for (const auto& command: commands) {
+      key += '\0' + makeRelativeToBaseDirectory(command.Directory, baseDirectory);
+      
+      for (const auto& argument: command.CommandLine) {
+        key += '\0' + makeArgumentRelativeToBaseDirectory(argument, baseDirectory);
       }
     }
     
-    const auto protocols = propertyInterfaceDecl->protocols();
+    key += '\0' + hashString(mainFileContents);
     
-    // For sure it is in some protocol!
-    const auto memberInProtocols = getMemberForProtocols<Result>(protocols, filter, protocolExtractor);
+    return hashString(key);
+  }
+  
+  // Cache entries and manifests are sequences of length-prefixed fields, so any generated code fits in them
+  auto writeCacheField(llvm::raw_ostream& stream, llvm::StringRef field) -> void
+  {
+    stream << field.size() << '\n' << field << '\n';
+  }
+  
+  auto readCacheField(llvm::StringRef& buffer, std::string& field) -> bool
+  {
+    const auto lengthAndRest = buffer.split('\n');
     
-    if (memberInProtocols != Result()) {
-      return memberInProtocols;
+    auto length = size_t{};
+    
+    if (lengthAndRest.first.getAsInteger(10, length) || lengthAndRest.second.size() < length + 1) {
+      return false;
     }
     
-    const auto superClassType = propertyInterfaceDecl->getSuperClassType();
+    field = lengthAndRest.second.substr(0, length);
+    buffer = lengthAndRest.second.substr(length + 1);
     
-    const auto isRootClass = (superClassType == nullptr);
+    return true;
+  }
+  
+  auto readCacheCount(llvm::StringRef& buffer, size_t& count) -> bool
+  {
+    auto field = std::string{};
+    
+    return readCacheField(buffer, field) && !llvm::StringRef{field}.getAsInteger(10, count);
+  }
+  
+  // Along with the hash of their contents when written, to know later if any of them changed
+  auto writeDependencies(llvm::raw_ostream& stream, const std::vector<std::string>& dependencies, llvm::StringRef baseDirectory = {}) -> void
+  {
+    writeCacheField(stream, std::to_string(dependencies.size()));
+    
+    for (const auto& dependency: dependencies) {
+      writeCacheField(stream, makeRelativeToBaseDirectory(dependency, baseDirectory));
+      writeCacheField(stream, hashFile(dependency));
+    }
+  }
+  
+  auto readDependencies(llvm::StringRef& buffer, std::vector<std::string>& dependencies, bool& isUnchanged, llvm::StringRef baseDirectory = {}) -> bool
+  {
+    auto count = size_t{};
+    
+    if (!readCacheCount(buffer, count)) {
+      return false;
+    }
+    
+    isUnchanged = true;
+    
+    for (auto i = size_t{}; i < count; i++) {
+      auto dependency = std::string{};
+      auto hash = std::string{};
+      
+      if (!readCacheField(buffer, dependency) || !readCacheField(buffer, hash)) {
+        return false;
+      }
+      
+      dependency = makeAbsoluteFromBaseDirectory(dependency, baseDirectory);
+      
+      // No need to read any other file once one has changed
+      isUnchanged = isUnchanged && hashFile(dependency) == hash;
+      dependencies.push_back(std::move(dependency));
+    }
+    
+    return true;
+  }
+  
+  auto writeCategory(llvm::raw_ostream& stream, const GeneratedCategory& category) -> void
+  {
+    writeCacheField(stream, category.usr);
+    writeCacheField(stream, category.semanticHash);
+    writeCacheField(stream, category.hostName);
+    writeCacheField(stream, category.typeName);
+    writeCacheField(stream, category.propertyName);
+    writeCacheField(stream, category.origin);
+    writeCacheField(stream, category.header);
+    writeCacheField(stream, category.implementation);
+    writeCacheField(stream, std::to_string(category.lazyMethods.size()));
+    
+    for (const auto& lazyMethod: category.lazyMethods) {
+      writeCacheField(stream, lazyMethod.isClassMethod ? "+" : "-");
+      writeCacheField(stream, lazyMethod.selector);
+      writeCacheField(stream, lazyMethod.functionName);
+      writeCacheField(stream, lazyMethod.typeEncoding);
+      writeCacheField(stream, lazyMethod.accessor);
+      writeCacheField(stream, lazyMethod.sharedDefinition);
+    }
+    
+    writeCacheField(stream, std::to_string(category.selectorKeys.size()));
+    
+    for (const auto& selectorKey: category.selectorKeys) {
+      writeCacheField(stream, selectorKey);
+    }
+  }
+  
+  auto readCategory(llvm::StringRef& buffer, GeneratedCategory& category) -> bool
+  {
+    auto lazyMethodCount = size_t{};
+    
+    const auto isValid = readCacheField(buffer, category.usr)
+                      && readCacheField(buffer, category.semanticHash)
+                      && readCacheField(buffer, category.hostName)
+                      && readCacheField(buffer, category.typeName)
+                      && readCacheField(buffer, category.propertyName)
+                      && readCacheField(buffer, category.origin)
+                      && readCacheField(buffer, category.header)
+                      && readCacheField(buffer, category.implementation)
+                      && readCacheCount(buffer, lazyMethodCount);
+    
+    if (!isValid) {
+      return false;
+    }
+    
+    category.lazyMethods.resize(lazyMethodCount);
+    
+    for (auto& lazyMethod: category.lazyMethods) {
+      auto methodType = std::string{};
+      
+      const auto isValidMethod = readCacheField(buffer, methodType)
+                              && readCacheField(buffer, lazyMethod.selector)
+                              && readCacheField(buffer, lazyMethod.functionName)
+                              && readCacheField(buffer, lazyMethod.typeEncoding)
+                              && readCacheField(buffer, lazyMethod.accessor)
+                              && readCacheField(buffer, lazyMethod.sharedDefinition);
+      
+      if (!isValidMethod) {
+        return false;
+      }
+      
+      lazyMethod.isClassMethod = (methodType == "+");
+    }
+    
+    auto selectorKeyCount = size_t{};
+    
+    if (!readCacheCount(buffer, selectorKeyCount)) {
+      return false;
+    }
+    
+    category.selectorKeys.resize(selectorKeyCount);
+    
+    for (auto& selectorKey: category.selectorKeys) {
+      if (!readCacheField(buffer, selectorKey)) {
+        return false;
+      }
+    }
+    
+    return true;
+  }
+  
+  // What the previous run generated, reused as long as what it was generated from did not change: translation units
+  // none of whose files changed are not parsed at all, and categories whose declarations are the same are not generated
+  struct IncrementalManifest
+  {
+    struct TranslationUnit
+    {
+      std::string key;
+      std::vector<std::string> dependencies;
+      std::vector<std::string> categoryUSRs;
+      bool isUnchanged = false;
+    };
+    
+    std::map<std::string, TranslationUnit> translationUnits;
+    std::map<std::string, GeneratedCategory> categories;
+    
+    // A manifest written by another tool build or with other output options is useless
+    auto load(llvm::StringRef path, llvm::StringRef baseKey) -> void
+    {
+      const auto buffer = llvm::MemoryBuffer::getFile(path);
+      
+      if (!buffer) {
+        return;
+      }
+      
+      auto contents = (*buffer)->getBuffer();
+      auto field = std::string{};
+      auto count = size_t{};
+      
+      if (!readCacheField(contents, field) || field != manifestFormatVersion
+          || !readCacheField(contents, field) || field != hashString(baseKey)
+          || !readCacheCount(contents, count)) {
+        return;
+      }
+      
+      auto loadedTranslationUnits = std::map<std::string, TranslationUnit>{};
+      
+      for (auto i = size_t{}; i < count; i++) {
+        auto translationUnitPath = std::string{};
+        auto translationUnit = TranslationUnit{};
+        auto usrCount = size_t{};
+        
+        if (!readCacheField(contents, translationUnitPath) || !readCacheField(contents, translationUnit.key)
+            || !readDependencies(contents, translationUnit.dependencies, translationUnit.isUnchanged)
+            || !readCacheCount(contents, usrCount)) {
+          return;
+        }
+        
+        translationUnit.categoryUSRs.resize(usrCount);
+        
+        for (auto& usr: translationUnit.categoryUSRs) {
+          if (!readCacheField(contents, usr)) {
+            return;
+          }
+        }
+        
+        loadedTranslationUnits[translationUnitPath] = std::move(translationUnit);
+      }
+      
+      auto loadedCategories = std::map<std::string, GeneratedCategory>{};
+      
+      if (!readCacheCount(contents, count)) {
+        return;
+      }
+      
+      for (auto i = size_t{}; i < count; i++) {
+        auto category = GeneratedCategory{};
+        
+        if (!readCategory(contents, category)) {
+          return;
+        }
+        
+        loadedCategories[category.usr] = std::move(category);
+      }
+      
+      translationUnits = std::move(loadedTranslationUnits);
+      categories = std::move(loadedCategories);
+    }
+    
+    // Registers what a translation unit generated last time instead of parsing it again, if none of its files changed
+    auto splice(const std::string& path, llvm::StringRef key, GeneratedCategoryRegistry& registry) const -> bool
+    {
+      const auto it = translationUnits.find(path);
+      
+      if (it == translationUnits.end() || !it->second.isUnchanged || it->second.key != key) {
+        return false;
+      }
+      
+      const auto& translationUnit = it->second;
+      
+      const auto hasAllCategories = std::all_of(std::begin(translationUnit.categoryUSRs), std::end(translationUnit.categoryUSRs), [&](const std::string& usr) {
+        return categories.count(usr) > 0;
+      });
+      
+      if (!hasAllCategories) {
+        return false;
+      }
+      
+      for (const auto& usr: translationUnit.categoryUSRs) {
+        if (registry.claim(path, usr)) {
+          registry.add(categories.at(usr));
+        }
+      }
+      
+      registry.finish(path, translationUnit.dependencies, false);
+      
+      return true;
+    }
+    
+    auto find(const std::string& usr, llvm::StringRef semanticHash) const -> const GeneratedCategory*
+    {
+      const auto it = categories.find(usr);
+      
+      if (it == categories.end() || it->second.semanticHash != semanticHash) {
+        return nullptr;
+      }
+      
+      return &it->second;
+    }
+    
+    // Translation units with errors are left out, so they are parsed again next time
+    static auto save(llvm::StringRef path,
+                     llvm::StringRef baseKey,
+                     const std::map<std::string, std::string>& translationUnitKeys,
+                     const GeneratedCategoryRegistry& registry) -> void
+    {
+      std::error_code error;
+      
+      llvm::raw_fd_ostream stream{path, error, llvm::sys::fs::F_RW};
+      
+      if (error) {
+        llvm::errs() << "Could not write the incremental manifest " << path << ": " << error.message() << '\n';
+        return;
+      }
+      
+      auto savedTranslationUnits = std::vector<std::pair<std::string, const TranslationUnitRecord*>>{};
+      
+      for (const auto& entry: registry.translationUnits) {
+        if (!entry.second.hasErrors && translationUnitKeys.count(entry.first) > 0) {
+          savedTranslationUnits.emplace_back(entry.first, &entry.second);
+        }
+      }
+      
+      writeCacheField(stream, manifestFormatVersion);
+      writeCacheField(stream, hashString(baseKey));
+      writeCacheField(stream, std::to_string(savedTranslationUnits.size()));
+      
+      for (const auto& translationUnit: savedTranslationUnits) {
+        const auto& record = *translationUnit.second;
+        
+        // Categories claimed by the translation unit but with nothing to provide are not in the registry
+        auto categoryUSRs = std::vector<std::string>{};
+        
+        std::copy_if(std::begin(record.categoryUSRs), std::end(record.categoryUSRs), std::back_inserter(categoryUSRs), [&](const std::string& usr) {
+          return registry.categories.count(usr) > 0;
+        });
+        
+        writeCacheField(stream, translationUnit.first);
+        writeCacheField(stream, translationUnitKeys.at(translationUnit.first));
+        writeDependencies(stream, record.dependencies);
+        writeCacheField(stream, std::to_string(categoryUSRs.size()));
+        
+        for (const auto& usr: categoryUSRs) {
+          writeCacheField(stream, usr);
+        }
+      }
+      
+      writeCacheField(stream, std::to_string(registry.categories.size()));
+      
+      for (const auto& category: registry.categories) {
+        writeCategory(stream, category.second);
+      }
+    }
+  };
+
+  // How the categories are generated, the same for all the translation units of a run
+  struct GenerationOptions
+  {
+    // When set, forwarders never called on their host classes are not generated
+    const SelectorUsage* selectorUsage = nullptr;
+    // When set, categories whose declarations did not change since it was written are reused
+    const IncrementalManifest* previousManifest = nullptr;
+    // Forwarders are installed by +resolveInstanceMethod: and +resolveClassMethod: the first time they are needed
+    bool lazyMethods = false;
+    // Only with lazyMethods
+    bool shareForwarders = false;
+  };
+
+  struct KnownDeclarations
+  {
+    template<typename T>
+    using LookupByInterfaceName = std::map<llvm::StringRef, T>;
+
+    LookupByInterfaceName<clang::ObjCInterfaceDecl*> interfaces;
+    LookupByInterfaceName<clang::ObjCInterfaceDecl*> parent;
+  };
+
+  template<typename F, typename D>
+  auto runIfInMainFile(clang::ASTContext& context, F function, D decl) -> bool
+  {
+    if (context.getSourceManager().isInMainFile(decl->getLocStart())) {
+      return function(decl);
+    }
+    
+    return true;
+  }
+  
+  // Declarations from any header which is not a system one are part of the project
+  template<typename F, typename D>
+  auto runIfInProjectFile(clang::ASTContext& context, F function, D decl) -> bool
+  {
+    if (!context.getSourceManager().isInSystemHeader(decl->getLocStart())) {
+      return function(decl);
+    }
+    
+    return true;
+  }
+  
+  auto formatLocation(const clang::SourceManager& sourceManager, clang::SourceLocation location) -> std::string
+  {
+    const auto presumedLocation = sourceManager.getPresumedLoc(sourceManager.getFileLoc(location));
+    
+    if (presumedLocation.isInvalid()) {
+      return "<unknown>";
+    }
+    
+    return llvm::formatv("{0}:{1}:{2}", presumedLocation.getFilename(), presumedLocation.getLine(), presumedLocation.getColumn());
+  }
+  
+  auto generateUSR(const clang::Decl* decl) -> std::string
+  {
+    auto usr = llvm::SmallString<128>{};
+    
+    const auto failed = clang::index::generateUSRForDecl(decl, usr);
+    
+    assert(!failed && "Could not generate an USR for the declaration");
+    
+    return usr.str();
+  }
+  
+  enum struct ProvidedItemType
+  {
+    InstanceMethod,
+    ClassMethod,
+    Property,
+    Unknown,
+  };
+  
+  struct ProvidedItem
+  {
+    ProvidedItemType type;
+    llvm::StringRef value;
+  };
+  
+  auto extractProvidedItems(const std::vector<clang::AnnotateAttr*>& attrs) -> std::vector<ProvidedItem>
+  {
+    auto splitList = llvm::SmallVector<llvm::StringRef, 10>();
+    
+    // TODO: handle errors on parsing provided items?
+    for (const auto attr: attrs) {
+      attr->getAnnotation().trim().substr(PROVIDE_TAG.size()).split(splitList, " ", -1, false);
+    }
+    
+    auto items = std::vector<ProvidedItem>{splitList.size()};
+    
+    std::transform(std::begin(splitList), std::end(splitList), begin(items), [](StringRef s) -> ProvidedItem {
+      assert(s.size() > 0);
+      
+      const auto type = [=]() -> ProvidedItemType {
+        switch(s[0]) {
+          case '@': return ProvidedItemType::Property;
+          case '-': return ProvidedItemType::InstanceMethod;
+          case '+': return ProvidedItemType::ClassMethod;
+        }
+        
+        assert(false && "Invalid Type!!!! FIXME: handle error");
+        
+        return ProvidedItemType::Unknown;
+      }();
+      
+      const auto value = s.substr(1);
+      
+      assert(value.size() > 0 && "Invalid Value!!! FIXME: handle error");
+      
+      return {type, value};
+    });
+    
+    return items;
+  }
+  
+  template<typename NodeType>
+  auto getParent(const CodeGeneratorContext& context, const NodeType o) -> const clang::ObjCContainerDecl*
+  {
+    assert(o != nullptr);
+    
+    auto& astContext = context.compilerInstance->getASTContext();
+    
+    for (const auto p: astContext.getParents(*o)) {
+        const auto parent = p.template get<clang::ObjCContainerDecl>();
+        
+        if (parent != nullptr) {
+          return parent;
+        }
+      }
+      
+      return nullptr;
+  }
+  
+  template<typename NodeType>
+  auto getInterfaceForMember(const CodeGeneratorContext& context, const NodeType member) -> const clang::ObjCInterfaceDecl*
+  {
+    const auto parent = getParent(context, member);
+    
+    assert(parent != nullptr);
+    
+    if (const auto interface = llvm::dyn_cast<clang::ObjCInterfaceDecl>(parent)) {
+      return interface;
+    }
+    
+    if (const auto category = llvm::dyn_cast<clang::ObjCCategoryDecl>(parent)) {
+      return category->getClassInterface();
+    }
+    
+    return nullptr;
+  }
+  
+  template<
+    typename Result,
+    typename Filter,
+    typename ProtocolExtractor>
+  auto getMemberForProtocols(llvm::iterator_range<clang::ObjCProtocolDecl*const*> protocols, Filter filter, ProtocolExtractor protocolExtractor) -> Result
+  {
+    for (const auto protocol: protocols) {
+      llvm::outs() << "checking member in protocol " << protocol->getName() << '\n';
+      const auto membersInProtocol = protocolExtractor(protocol);
+      
+      const auto it = std::find_if(std::begin(membersInProtocol), std::end(membersInProtocol), filter);
+      
+      if (it != std::end(membersInProtocol)) {
+        return *it;
+      }
+    }
+    
+    // Depth first search on referenced protocols tree!
+    for (const auto protocol: protocols) {
+      llvm::outs() << "entering recursively in " << protocol->getName() << '\n';
+      const auto referencedProtocols = protocol->protocols();
+      const auto memberInReferencedProtocol = getMemberForProtocols<Result>(referencedProtocols, filter, protocolExtractor);
+      
+      if (memberInReferencedProtocol != Result()) {
+        return memberInReferencedProtocol;
+      }
+    }
+    
+    return Result();
+  }
+  
+  // FIXME: this method is way too big! Split it in small pieces!
+  template<
+    typename Result,
+    typename Filter,
+    typename InterfaceExtractor,
+    typename CategoryExtractor, 
+    typename ProtocolExtractor>
+  auto getMemberForObjectInterfaceType(const clang::ObjCInterfaceType* interfaceType,
+                       Filter filter,
+                       InterfaceExtractor interfaceExtractor,
+                       CategoryExtractor categoryExtractor,
+                       ProtocolExtractor protocolExtractor) -> Result
+  {
+    const auto propertyInterfaceDecl = interfaceType->getDecl();
+    const auto categories = propertyInterfaceDecl->known_categories();
+    const auto membersInInterface = interfaceExtractor(propertyInterfaceDecl);
+    
+    // FIXME: there's no need for building the list of pairs!
+    auto pairs = std::vector<std::pair<decltype(membersInInterface.begin()), decltype(membersInInterface.end())>>{};
+    pairs.emplace_back(membersInInterface.begin(), membersInInterface.end());
+    
+    for (const auto& category: categories) {
+      const auto membersInCategory = categoryExtractor(category);
+      pairs.emplace_back(membersInCategory.begin(), membersInCategory.end());
+    }
+    
+    for (const auto pairIt: pairs) {
+      const auto it = std::find_if(pairIt.first, pairIt.second, filter);
+  
+      if (it != pairIt.second) {
+        return *it;
+      }
+    }
+    
+    const auto protocols = propertyInterfaceDecl->protocols();
+    
+    // For sure it is in some protocol!
+    const auto memberInProtocols = getMemberForProtocols<Result>(protocols, filter, protocolExtractor);
+    
+    if (memberInProtocols != Result()) {
+      return memberInProtocols;
+    }
+    
+    const auto superClassType = propertyInterfaceDecl->getSuperClassType();
+    
+    const auto isRootClass = (superClassType == nullptr);
     
     if (isRootClass) {
       llvm::outs() << "Could not find something in " << propertyInterfaceDecl->getName() << " neither on it's parent :-(\n";
       return Result();
     }
     
-    // Look for the member in the parent, in case we are not in a root class (NSObject or similar)
-    // It's recursive, but as the class hierarchy is not deep (what are you doing?!),
-    // there is no problems of stack overflow
-    return getMemberForObjectInterfaceType<Result>(llvm::dyn_cast<clang::ObjCInterfaceType>(superClassType),
-                                                  filter, interfaceExtractor, categoryExtractor, protocolExtractor);
+    // Look for the member in the parent, in case we are not in a root class (NSObject or similar)
+    // It's recursive, but as the class hierarchy is not deep (what are you doing?!),
+    // there is no problems of stack overflow
+    return getMemberForObjectInterfaceType<Result>(llvm::dyn_cast<clang::ObjCInterfaceType>(superClassType),
+                                                  filter, interfaceExtractor, categoryExtractor, protocolExtractor);
+  }
+  
+  template<
+    typename Result,
+    typename Filter,
+    typename InterfaceExtractor,
+    typename CategoryExtractor, 
+    typename ProtocolExtractor>
+  auto getMemberForObjectType(const clang::ObjCObjectPointerType* pointerType,
+                       Filter filter,
+                       InterfaceExtractor interfaceExtractor,
+                       CategoryExtractor categoryExtractor,
+                       ProtocolExtractor protocolExtractor) -> Result
+  {
+    const auto type = pointerType->getObjectType();
+    
+    llvm::outs() << "Dumping type \n";
+    type->dump();
+    
+    const auto resultInInterface = [=] {
+      if (const auto interfaceType = llvm::dyn_cast<clang::ObjCInterfaceType>(type)) {
+        return getMemberForObjectInterfaceType<Result>(interfaceType, filter, interfaceExtractor, categoryExtractor, protocolExtractor);
+      }
+
+      return Result();
+    }();
+    
+    if (resultInInterface != nullptr) {
+      return resultInInterface;
+    }
+    
+    assert(!type->isObjCClass() && "FIXME: Sorry, not support for properties of type Class yet :-(");
+   
+    // Could not find anything in the property interface type or any of its extensions or protocols.
+    // Let's now look at the protocols specified in the property type
+    // e.g: in `@property NSString<Prot1, Prot2>* prop;` look at Prot1 and Prot2
+    for (auto i = 0u, numberOfProtocols = pointerType->getNumProtocols(); i < numberOfProtocols; i++) {
+      const auto protocol = pointerType->getProtocol(i);
+      
+      // FIXME: this is copy&paste from above
+      const auto membersInProtocol = protocolExtractor(protocol);
+      
+      const auto it = std::find_if(membersInProtocol.begin(), membersInProtocol.end(), filter);
+      
+      if (it != membersInProtocol.end()) {
+        return *it;
+      }
+    }
+    
+    return nullptr;
+  }
+  
+  template<typename Extractor>
+  auto getSelectorForInterface(const clang::ObjCObjectPointerType* type, const StringRef selectorName, Extractor extractor) -> clang::ObjCMethodDecl*
+  {
+    const auto filter = [=](const clang::ObjCMethodDecl* methodDecl) {
+      llvm::outs() << "Comparing " << methodDecl->getSelector().getAsString() << " with " << selectorName << '\n';
+      return methodDecl->getSelector().getAsString() == selectorName;
+    };
+    
+    return getMemberForObjectType<clang::ObjCMethodDecl*>(type, filter, extractor, extractor, extractor);
+  }
+  
+  auto getInstanceSelectorForObjectType(const clang::ObjCObjectPointerType* type, const StringRef selectorName) -> clang::ObjCMethodDecl*
+  {
+    const auto extractor = [](const clang::ObjCContainerDecl* container) {
+      return container->instance_methods();
+    };
+    
+    return getSelectorForInterface(type, selectorName, extractor);
+  }
+  
+  auto getClassSelectorForObjectType(const clang::ObjCObjectPointerType* type, const StringRef selectorName) -> clang::ObjCMethodDecl*
+  {
+    const auto extractor = [](const clang::ObjCContainerDecl* container) {
+      return container->class_methods();
+    };
+    
+    return getSelectorForInterface(type, selectorName, extractor);
+  }
+  
+  template<typename Extractor>
+  auto getPropertyForObjectType(const clang::ObjCObjectPointerType* type, const StringRef propertyName, Extractor extractor) -> clang::ObjCPropertyDecl*
+  {
+    const auto filter = [=](const clang::ObjCPropertyDecl* propertyDecl) {
+      llvm::outs() << "comparing " << propertyDecl->getName() << " with " << propertyName << '\n';
+      return propertyDecl->getName() == propertyName;
+    };
+    
+    return getMemberForObjectType<clang::ObjCPropertyDecl*>(type, filter, extractor, extractor, extractor);
+  }
+  
+  auto getInstancePropertyForObjectType(const clang::ObjCObjectPointerType* type, const StringRef propertyName) -> clang::ObjCPropertyDecl*
+  {
+    const auto extractor = [](const clang::ObjCContainerDecl* container) {
+      return container->instance_properties();
+    };
+    
+    return getPropertyForObjectType(type, propertyName, extractor);
+  }
+  
+  auto getClassPropertyForObjectType(const clang::ObjCObjectPointerType* type, const StringRef propertyName) -> clang::ObjCPropertyDecl*
+  {
+    const auto extractor = [](const clang::ObjCContainerDecl* container) {
+      return container->class_properties();
+    };
+    
+    return getPropertyForObjectType(type, propertyName, extractor);
+  }
+  
+  auto generateCallBody(clang::ObjCMethodDecl* selectorInProperty) -> std::string
+  {
+     const auto selectorNameAsStdString = selectorInProperty->getSelector().getAsString();
+          
+     if (selectorInProperty->getSelector().getNumArgs() == 0) {
+       return selectorNameAsStdString;
+     }
+     
+     // yep, it's a view of the std::string version. Not so fancy, but works
+     const auto selectorName = llvm::StringRef{selectorNameAsStdString};
+     
+     const auto parameters = selectorInProperty->parameters();
+
+     auto paramLabels = llvm::SmallVector<llvm::StringRef, 10>{};
+     selectorName.split(paramLabels, ":", -1, false);
+
+     // TODO: use stream instead
+     auto callBody = std::string{};
+
+     // FIXME: it fails for methods with no arguments!
+     assert(paramLabels.size() == parameters.size());
+
+     for (size_t size = parameters.size(), i = 0u; i < size; i++) {
+       callBody += paramLabels[i];
+       callBody += ":";
+       callBody += parameters[i]->getName();
+       if (i < size - 1) {
+         callBody += " ";
+       }
+       llvm::outs() << paramLabels[i] << ":" << parameters[i]->getName() << " " << "\n";
+     }
+
+     return callBody;
+  }
+  
+  auto generateSelectorDefinition(clang::ObjCMethodDecl* selectorInProperty,
+                                  const std::string& selectorSignature,
+                                  const std::string& memberTODORenameMeForSomethingThatRefersToClassToo) -> std::string
+  {
+    return llvm::formatv(objCSelectorImplementationFormat,
+                         selectorSignature,
+                         memberTODORenameMeForSomethingThatRefersToClassToo,
+                         generateCallBody(selectorInProperty));
+  }
+  
+  auto generateSelectorSignature(clang::ObjCMethodDecl* selector) -> std::string
+  {
+    const auto returnType = selector->getReturnType();
+    
+    const auto signatureCore = [&]() -> std::string {
+      const auto parameters = selector->parameters();
+      
+      // FIXME: this is copy@paste
+      const auto selectorNameAsStdString = selector->getSelector().getAsString();
+      
+      llvm::outs() << "analysing selector " << selector->getSelector().getAsString() << '\n';
+      
+      if (parameters.empty()) {
+        return selectorNameAsStdString;
+      }
+      
+      const auto selectorName = llvm::StringRef{selectorNameAsStdString.data(), selectorNameAsStdString.size()};
+      
+      auto paramLabels = llvm::SmallVector<llvm::StringRef, 10>{};
+      selectorName.split(paramLabels, ":", -1, false);
+
+      // FIXME: this is copy&paste code
+      
+      // TODO: use stream instead
+      auto callBody = std::string{};
+
+      // FIXME: it fails for methods with no arguments!
+      assert(paramLabels.size() == parameters.size());
+
+      for (size_t size = parameters.size(), i = 0u; i < size; i++) {
+        callBody += llvm::formatv("{0}:({1}){2} ", paramLabels[i], parameters[i]->getType().getAsString(), parameters[i]->getName());
+      }
+      
+      return callBody;
+    }();
+    
+    const auto methodType = selector->isClassMethod() ? "+" : "-";
+    
+    return llvm::formatv(objCSelectorSignatureFormat, methodType, returnType.getAsString(), signatureCore);
+  }
+    
+  auto getPropertyPointerType(clang::ObjCPropertyDecl* o)
+  {
+    return llvm::dyn_cast<clang::ObjCObjectPointerType>(o->getTypeSourceInfo()->getType().getTypePtrOrNull());
+  }
+  
+  auto formatObjectType(const clang::ObjCObjectType* type) -> std::string
+  {
+    // An interface with no protocols or generic types
+    if (const auto interfaceType = llvm::dyn_cast<clang::ObjCInterfaceType>(type)) {
+      return interfaceType->getDecl()->getName();
+    }
+    
+    const auto objType = llvm::dyn_cast<clang::ObjCObjectType>(type);
+    
+    if (objType == nullptr) {
+      assert(false && "Unknown type!!!");
+      return "";
+    }
+    
+    const auto interface = objType->getInterface();
+    
+    if (interface != nullptr) {
+      return std::string{interface->getName()} + "_FIXME_EXTRACT_PROTOCOL_AND_GENERIC_ARGUMENTS";
+    }
+    
+    assert(type->isObjCId() && "This type should be id!!!!");
+    
+    return "id_FIXME_EXTRACT_PROTOCOL_ARGUMENTS";
+  }
+  
+  auto isForwarderUsed(const CodeGeneratorContext& context,
+                       const clang::ObjCPropertyDecl* propertyDecl,
+                       const clang::ObjCMethodDecl* methodDecl) -> bool
+  {
+    if (context.selectorUsage == nullptr) {
+      return true;
+    }
+    
+    // e.g. the setter of a readonly property
+    if (methodDecl == nullptr) {
+      return false;
+    }
+    
+    const auto hostDecl = getInterfaceForMember(context, propertyDecl);
+    
+    assert(hostDecl != nullptr);
+    
+    const auto selectorKey = formatSelectorKey(methodDecl->isClassMethod(), methodDecl->getSelector().getAsString());
+    
+    return context.selectorUsage->isUsed(hostDecl->getName(), selectorKey);
+  }
+  
+  auto reportRemovedForwarder(const CodeGeneratorContext& context,
+                              const clang::ObjCPropertyDecl* propertyDecl,
+                              ProvidedItem item) -> void
+  {
+    const auto hostDecl = getInterfaceForMember(context, propertyDecl);
+    
+    assert(hostDecl != nullptr);
+    
+    const auto typeTag = [=]() -> llvm::StringRef {
+      switch(item.type) {
+        case ProvidedItemType::Property: return "@";
+        case ProvidedItemType::InstanceMethod: return "-";
+        case ProvidedItemType::ClassMethod: return "+";
+        case ProvidedItemType::Unknown: break;
+      }
+      
+      return "?";
+    }();
+    
+    llvm::outs() << "Removed unused forwarder " << typeTag << item.value << " from "
+                 << hostDecl->getName() << " (provided by " << propertyDecl->getName() << ")\n";
+  }
+  
+  auto escapeCString(llvm::StringRef string) -> std::string
+  {
+    auto escaped = std::string{};
+    
+    for (const auto c: string) {
+      if (c == '"' || c == '\\') {
+        escaped += '\\';
+      }
+      
+      escaped += c;
+    }
+    
+    return escaped;
+  }
+  
+  // Declaration of name as type, which wraps the name for blocks and function pointers, e.g. void (^name)(int)
+  auto formatDeclarator(const CodeGeneratorContext& context, clang::QualType type, const llvm::Twine& name) -> std::string
+  {
+    auto declarator = std::string{};
+    llvm::raw_string_ostream stream{declarator};
+    
+    type.print(stream, context.compilerInstance->getASTContext().getPrintingPolicy(), name);
+    
+    return stream.str();
+  }
+  
+  // Methods of the alloc, copy, mutableCopy, new and init families return +1, unless annotated otherwise
+  auto isReturningRetained(const clang::ObjCMethodDecl* method) -> bool
+  {
+    if (!method->getReturnType()->isObjCRetainableType() || method->hasAttr<clang::NSReturnsNotRetainedAttr>()) {
+      return false;
+    }
+    
+    if (method->hasAttr<clang::NSReturnsRetainedAttr>()) {
+      return true;
+    }
+    
+    switch (method->getMethodFamily()) {
+      case clang::OMF_alloc:
+      case clang::OMF_copy:
+      case clang::OMF_init:
+      case clang::OMF_mutableCopy:
+      case clang::OMF_new:
+        return true;
+        
+      default:
+        return false;
+    }
+  }
+  
+  auto isConsumingSelf(const clang::ObjCMethodDecl* method) -> bool
+  {
+    return method->getMethodFamily() == clang::OMF_init || method->hasAttr<clang::NSConsumesSelfAttr>();
+  }
+  
+  // Type encoding as the runtime expects for class_addMethod(), e.g. "v@:@" for -(void)doSomething:(id)smth
+  auto generateTypeEncoding(const CodeGeneratorContext& context, clang::ObjCMethodDecl* selector) -> std::string
+  {
+    auto& astContext = context.compilerInstance->getASTContext();
+    
+    auto encoding = std::string{};
+    astContext.getObjCEncodingForType(selector->getReturnType(), encoding);
+    encoding += "@:";
+    
+    for (const auto parameter: selector->parameters()) {
+      astContext.getObjCEncodingForType(parameter->getType(), encoding);
+    }
+    
+    return encoding;
+  }
+  
+  // Forwarders of different hosts only differing in the property they read share the same code: class methods
+  // do not read any, the others are created from a factory given the accessor of the property
+  auto generateSharedLazyMethod(const CodeGeneratorContext& context,
+                                const clang::ObjCPropertyDecl* receiverProperty,
+                                clang::ObjCMethodDecl* selectorInProperty,
+                                const std::string& receiver,
+                                clang::QualType returnType,
+                                const std::string& parameters,
+                                LazyMethod& lazyMethod) -> void
+  {
+    const auto callBody = generateCallBody(selectorInProperty);
+    const auto receiverType = receiverProperty != nullptr ? receiverProperty->getType().getAsString() : receiver;
+    
+    lazyMethod.functionName = llvm::formatv(objCSharedForwarderNameFormat,
+                                            hashString(formatSelectorKey(lazyMethod.isClassMethod, lazyMethod.selector) + '\0'
+                                                       + lazyMethod.typeEncoding + '\0' + returnType.getAsString() + '\0' + parameters + '\0'
+                                                       + receiverType + '\0' + callBody)).str();
+    
+    if (receiverProperty == nullptr) {
+      const auto declarator = llvm::formatv(objCLazyMethodFunctionDeclaratorFormat, lazyMethod.functionName, "Class", parameters).str();
+      
+      lazyMethod.sharedDefinition = llvm::formatv(objCLazyMethodFunctionFormat,
+                                                  formatDeclarator(context, returnType, declarator),
+                                                  receiver,
+                                                  callBody).str();
+      return;
+    }
+    
+    const auto resultType = llvm::formatv(objCSharedForwarderResultTypeFormat, lazyMethod.functionName).str();
+    
+    lazyMethod.accessor = receiverProperty->getGetterName().getAsString();
+    lazyMethod.sharedDefinition = llvm::formatv(objCSharedForwarderFactoryFormat,
+                                                lazyMethod.functionName,
+                                                formatDeclarator(context, returnType, resultType),
+                                                resultType,
+                                                parameters,
+                                                formatDeclarator(context, receiverProperty->getType(), "(*)(id, SEL)"),
+                                                callBody).str();
+  }
+  
+  auto generateLazyMethodFunction(const CodeGeneratorContext& context,
+                                  clang::ObjCPropertyDecl* propertyDecl,
+                                  const clang::ObjCPropertyDecl* receiverProperty,
+                                  clang::ObjCMethodDecl* selectorInProperty,
+                                  const std::string& receiver) -> void
+  {
+    const auto hostDecl = getInterfaceForMember(context, propertyDecl);
+    
+    assert(hostDecl != nullptr);
+    
+    auto lazyMethod = LazyMethod{};
+    lazyMethod.isClassMethod = selectorInProperty->isClassMethod();
+    lazyMethod.selector = selectorInProperty->getSelector().getAsString();
+    lazyMethod.typeEncoding = escapeCString(generateTypeEncoding(context, selectorInProperty));
+    
+    // instancetype is only allowed in methods
+    const auto returnType = selectorInProperty->hasRelatedResultType() ? context.compilerInstance->getASTContext().getObjCIdType()
+                                                                       : selectorInProperty->getReturnType();
+    
+    auto parameters = std::string{};
+    
+    for (const auto parameter: selectorInProperty->parameters()) {
+      const auto attribute = parameter->hasAttr<clang::NSConsumedAttr>() ? objCConsumedAttribute : "";
+      parameters += llvm::formatv(objCLazyMethodParameterFormat, attribute + formatDeclarator(context, parameter->getType(), parameter->getName()));
+    }
+    
+    // A block cannot be annotated like the function of an unshared forwarder, and always returns +0
+    const auto isTransferringOwnership = isReturningRetained(selectorInProperty) || isConsumingSelf(selectorInProperty)
+                                      || std::any_of(selectorInProperty->param_begin(), selectorInProperty->param_end(), [](const clang::ParmVarDecl* parameter) {
+                                           return parameter->hasAttr<clang::NSConsumedAttr>();
+                                         });
+    
+    if (context.shareForwarders && !isTransferringOwnership) {
+      generateSharedLazyMethod(context, receiverProperty, selectorInProperty, receiver, returnType, parameters, lazyMethod);
+      context.lazyMethods->push_back(std::move(lazyMethod));
+      return;
+    }
+    
+    lazyMethod.functionName = llvm::formatv(objCLazyMethodFunctionNameFormat,
+                                            hostDecl->getName(),
+                                            formatObjectType(getPropertyPointerType(propertyDecl)->getObjectType()),
+                                            propertyDecl->getName(),
+                                            lazyMethod.isClassMethod ? "c" : "i",
+                                            lazyMethod.selector).str();
+    
+    std::replace(std::begin(lazyMethod.functionName), std::end(lazyMethod.functionName), ':', '_');
+    
+    // The caller of the method follows its conventions, so must the function implementing it
+    const auto selfAttribute = isConsumingSelf(selectorInProperty) ? objCConsumedAttribute : "";
+    const auto selfType = selfAttribute + (lazyMethod.isClassMethod ? "Class" : hostDecl->getName().str() + "*");
+    const auto returnAttribute = isReturningRetained(selectorInProperty) ? objCReturnsRetainedAttribute : "";
+    
+    const auto declarator = llvm::formatv(objCLazyMethodFunctionDeclaratorFormat, lazyMethod.functionName, selfType, parameters).str();
+    
+    context.implStream << llvm::formatv(objCLazyMethodFunctionFormat,
+                                        returnAttribute + formatDeclarator(context, returnType, declarator),
+                                        receiver,
+                                        generateCallBody(selectorInProperty));
+    
+    context.lazyMethods->push_back(std::move(lazyMethod));
+  }
+  
+  // receiverProperty is the property of the host read by the receiver, if any
+  auto generateForwarder(const CodeGeneratorContext& context,
+                         clang::ObjCPropertyDecl* propertyDecl,
+                         const clang::ObjCPropertyDecl* receiverProperty,
+                         clang::ObjCMethodDecl* selectorInProperty,
+                         const std::string& selectorSignature,
+                         const std::string& receiver) -> void
+  {
+    if (context.selectorKeys != nullptr) {
+      context.selectorKeys->push_back(formatSelectorKey(selectorInProperty->isClassMethod(), selectorInProperty->getSelector().getAsString()));
+    }
+    
+    if (context.lazyMethods != nullptr) {
+      generateLazyMethodFunction(context, propertyDecl, receiverProperty, selectorInProperty, receiver);
+      return;
+    }
+    
+    context.implStream << generateSelectorDefinition(selectorInProperty, selectorSignature, receiver);
+  }
+  
+  auto generateCodeForInstanceMethod(CodeGeneratorContext& context, clang::ObjCPropertyDecl* propertyDecl, ProvidedItem item) -> void
+  {
+    const auto selectorName = item.value;
+    const auto type = getPropertyPointerType(propertyDecl);
+    const auto selectorInProperty = getInstanceSelectorForObjectType(type, selectorName);
+    assert(selectorInProperty != nullptr);
+    if (!isForwarderUsed(context, propertyDecl, selectorInProperty)) {
+      reportRemovedForwarder(context, propertyDecl, item);
+      return;
+    }
+    const auto selectorSignature = generateSelectorSignature(selectorInProperty);
+    context.headerStream << selectorSignature << ";\n\n";
+    const auto memberDef = llvm::formatv(objcInstanceSelectorForwardingFormat, propertyDecl->getName());
+    generateForwarder(context, propertyDecl, propertyDecl, selectorInProperty, selectorSignature, memberDef);
+  }
+  
+  auto generateCodeForClassMethod(CodeGeneratorContext& context, clang::ObjCPropertyDecl* propertyDecl, ProvidedItem item) -> void
+  {
+    const auto selectorName = item.value;
+    const auto type = getPropertyPointerType(propertyDecl);
+    const auto selectorInProperty = getClassSelectorForObjectType(type, selectorName);
+    assert(selectorInProperty != nullptr);
+    if (!isForwarderUsed(context, propertyDecl, selectorInProperty)) {
+      reportRemovedForwarder(context, propertyDecl, item);
+      return;
+    }
+    const auto selectorSignature = generateSelectorSignature(selectorInProperty);
+    context.headerStream << selectorSignature << ";\n\n";
+    const auto memberDef = llvm::formatv(objcClassSelectorForwardingFormat, formatObjectType(type->getObjectType()));
+    generateForwarder(context, propertyDecl, nullptr, selectorInProperty, selectorSignature, memberDef);
+  }
+  
+  auto generateCodeForProperty(CodeGeneratorContext& context, clang::ObjCPropertyDecl* propertyDecl, ProvidedItem item) -> void
+  {
+    const auto memberPropertyName = item.value;
+    const auto type = getPropertyPointerType(propertyDecl);
+    
+    const auto propertyDeclInMember = [&]() -> clang::ObjCPropertyDecl* {
+      if (const auto instanceProperty = getInstancePropertyForObjectType(type, memberPropertyName)) {
+        return instanceProperty;
+      }
+    
+      return getClassPropertyForObjectType(type, memberPropertyName);
+    }();
+    
+    assert(propertyDeclInMember != nullptr);
+    
+    const auto getterMethodDecl = propertyDeclInMember->getGetterMethodDecl();
+    const auto setterMethodDecl = propertyDeclInMember->getSetterMethodDecl();
+    
+    // Both accessors are kept if any of them is called, as the category declares the whole property
+    const auto isPropertyUsed = isForwarderUsed(context, propertyDecl, getterMethodDecl)
+                             || isForwarderUsed(context, propertyDecl, setterMethodDecl);
+    
+    if (!isPropertyUsed) {
+      reportRemovedForwarder(context, propertyDecl, item);
+      return;
+    }
+    
+    const auto locStart = propertyDeclInMember->getLocStart();
+    // FIXME: locEnd is pointing to the beginning of the property name :-(
+    const auto locEnd = propertyDeclInMember->getLocEnd();
+    
+    const auto codeBegin = context.compilerInstance->getSourceManager().getCharacterData(locStart);
+    const auto codeEnd = context.compilerInstance->getSourceManager().getCharacterData(locEnd);
+    const auto propertySignature = llvm::StringRef(codeBegin, codeEnd - codeBegin);
+    
+    llvm::outs() << "Property signature: " << propertySignature << '\n';
+    
+    context.headerStream << propertySignature;
+    context.headerStream << propertyDeclInMember->getName() << ";\n\n";
+    
+    const auto f = [&]() -> std::string {
+      if (propertyDeclInMember->isInstanceProperty()) {
+        return llvm::formatv(objcInstanceSelectorForwardingFormat, propertyDeclInMember->getName());
+      }
+      
+      return llvm::formatv(objcClassSelectorForwardingFormat, formatObjectType(type->getObjectType()));
+    }();
+    
+    const auto receiverProperty = propertyDeclInMember->isInstanceProperty() ? propertyDeclInMember : nullptr;
+    
+    if (getterMethodDecl != nullptr) {
+      const auto selectorSignature = generateSelectorSignature(getterMethodDecl);
+      generateForwarder(context, propertyDecl, receiverProperty, getterMethodDecl, selectorSignature, f);
+    }
+    
+    if (setterMethodDecl != nullptr) {
+      const auto selectorSignature = generateSelectorSignature(setterMethodDecl);
+      generateForwarder(context, propertyDecl, receiverProperty, setterMethodDecl, selectorSignature, f);
+    }
+  }
+  
+  using ProvidedItemGenerator = std::add_pointer<void(CodeGeneratorContext&, clang::ObjCPropertyDecl*, ProvidedItem)>::type;
+  
+  const std::map<ProvidedItemType, ProvidedItemGenerator> generators {
+    {ProvidedItemType::InstanceMethod, generateCodeForInstanceMethod},
+    {ProvidedItemType::ClassMethod, generateCodeForClassMethod},
+    {ProvidedItemType::Property, generateCodeForProperty},
+  };
+ 
+  // FIXME: no needs to say this function is way too large, doing too much and with a lot of copy&paste, right?
+  auto generateExtension(clang::ObjCPropertyDecl* o,
+                         CodeGeneratorContext& context,
+                         const std::vector<clang::AnnotateAttr*>& attrs,
+                         const KnownDeclarations& knownDeclarations,
+                         GeneratedCategory& category) -> bool
+  {
+    const auto providedItems = extractProvidedItems(attrs);
+
+    if (providedItems.empty()) {
+      return false;
+    }
+    
+    const auto parent = getParent(context, o);
+    
+    assert(parent != nullptr);
+    
+    const auto interfaceDecl = llvm::dyn_cast<clang::ObjCInterfaceDecl>(parent);
+    
+    assert(interfaceDecl != nullptr);
+    
+    for (const auto& attr: attrs) {
+      const auto annotationValue = attr->getAnnotation();
+      llvm::outs() << "Found a property annotation!!! " << annotationValue << '\n';
+      o->dump();
+    }
+    
+    const auto propertyType = getPropertyPointerType(o);
+    
+    assert(propertyType != nullptr);
+    
+    category.hostName = interfaceDecl->getName();
+    category.typeName = formatObjectType(propertyType->getObjectType());
+    category.propertyName = o->getName();
+    
+    for (const auto item: providedItems) {
+      assert(item.type != ProvidedItemType::Unknown && "FIXME: handle error");
+      const auto generator = generators.at(item.type);
+      llvm::outs() << "Processing item: " << item.value << '\n';
+      generator(context, o, item);
+    }
+    
+    return true;
+  }
+  
+  auto describeMethod(clang::ObjCMethodDecl* methodDecl) -> std::string
+  {
+    if (methodDecl == nullptr) {
+      return "";
+    }
+    
+    const auto container = llvm::dyn_cast<clang::ObjCContainerDecl>(methodDecl->getDeclContext());
+    
+    return generateSelectorSignature(methodDecl) + '\1' + (container != nullptr ? container->getName().str() : "");
+  }
+  
+  auto describeHierarchy(const clang::ObjCInterfaceDecl* interface) -> std::string
+  {
+    auto description = std::string{};
+    
+    for (; interface != nullptr; interface = interface->getSuperClass()) {
+      description += '\1' + interface->getName().str();
+    }
+    
+    return description;
+  }
+  
+  // Hash of what the category of a property is generated from: the property itself, its host and type hierarchies
+  // and each provided member as found in the type. If it did not change, neither did the generated code.
+  auto computeSemanticHash(clang::ObjCPropertyDecl* o, const std::vector<clang::AnnotateAttr*>& attrs) -> std::string
+  {
+    const auto type = getPropertyPointerType(o);
+    
+    assert(type != nullptr);
+    
+    const auto hostDecl = [&]() -> const clang::ObjCInterfaceDecl* {
+      if (const auto category = llvm::dyn_cast<clang::ObjCCategoryDecl>(o->getDeclContext())) {
+        return category->getClassInterface();
+      }
+      
+      return llvm::dyn_cast<clang::ObjCInterfaceDecl>(o->getDeclContext());
+    }();
+    
+    auto description = o->getName().str() + '\0' + o->getType().getAsString();
+    description += '\0' + describeHierarchy(hostDecl);
+    description += '\0' + describeHierarchy(type->getInterfaceDecl());
+    
+    for (const auto item: extractProvidedItems(attrs)) {
+      description += '\0' + item.value.str();
+      
+      switch (item.type) {
+        case ProvidedItemType::InstanceMethod:
+          description += describeMethod(getInstanceSelectorForObjectType(type, item.value));
+          break;
+        case ProvidedItemType::ClassMethod:
+          description += describeMethod(getClassSelectorForObjectType(type, item.value));
+          break;
+        case ProvidedItemType::Property: {
+          auto propertyDecl = getInstancePropertyForObjectType(type, item.value);
+          
+          if (propertyDecl == nullptr) {
+            propertyDecl = getClassPropertyForObjectType(type, item.value);
+          }
+          
+          if (propertyDecl != nullptr) {
+            description += propertyDecl->getType().getAsString() + '\1' + std::to_string(propertyDecl->getPropertyAttributes());
+            description += describeMethod(propertyDecl->getGetterMethodDecl());
+            description += describeMethod(propertyDecl->getSetterMethodDecl());
+          }
+          
+          break;
+        }
+        case ProvidedItemType::Unknown:
+          break;
+      }
+    }
+    
+    return hashString(description);
+  }
+}
+
+struct ObjCVisitor: public clang::RecursiveASTVisitor<ObjCVisitor>
+{
+  clang::CompilerInstance* _compilerInstance;
+  std::string _inputFilename;
+  GenerationOptions _options;
+  GeneratedCategoryRegistry& _generatedCategories;
+  KnownDeclarations& _knownDeclarations;
+
+  template<typename F, typename D>
+  auto visit(F function, D decl) const -> bool
+  {
+    return ::runIfInMainFile(_compilerInstance->getASTContext(), function, decl);
+  }
+  
+  template<typename F, typename D>
+  auto visitInProject(F function, D decl) const -> bool
+  {
+    return ::runIfInProjectFile(_compilerInstance->getASTContext(), function, decl);
+  }
+  
+  ObjCVisitor(clang::CompilerInstance* compilerInstance,
+              llvm::StringRef inputFilename,
+              GenerationOptions options,
+              GeneratedCategoryRegistry& generatedCategories,
+              KnownDeclarations& knownDeclarations):
+  _compilerInstance(compilerInstance),
+  _inputFilename(inputFilename),
+  _options(options),
+  _generatedCategories(generatedCategories),
+  _knownDeclarations(knownDeclarations)
+  {
+  }
+
+  auto VisitObjCInterfaceDecl(clang::ObjCInterfaceDecl* o) -> bool
+  {
+    //llvm::outs() << "New interface: " << o->getName() << '\n';
+    //o->getLocation().print(llvm::outs(), _compilerInstance->getSourceManager());
+    
+    visit([](clang::ObjCInterfaceDecl* o) {
+      return true;
+    }, o);
+    
+    _knownDeclarations.interfaces[o->getName()] = o;
+    return true;
+  }
+  
+  auto VisitObjCProtocolDecl(clang::ObjCProtocolDecl* o) -> bool
+  {
+    return true;
+  }
+  
+  auto VisitObjCMethodDecl(clang::ObjCMethodDecl* s) -> bool
+  {
+    //llvm::outs() << "Analysing selector " << s->getSelector().getAsString() << '\n';
+
+   return true;
+  }
+    
+  auto VisitObjCCategoryDecl(clang::ObjCCategoryDecl* o) -> bool
+  {
+    const auto interface = o->getClassInterface();
+    //llvm::outs() << "LALALA category decl: " << o->getName() << " for interface: " << interface->getName() << '\n';
+    return true;
+  }
+ 
+  auto VisitObjCImplementationDecl(clang::ObjCImplementationDecl* o) -> bool
+  {
+    // FIXME: do we really need to visit implementations of classes?
+    return visit([](clang::ObjCImplementationDecl *o) {
+        llvm::outs() << "visiting impl decl " << o->getName() << '\n';
+        return true;
+    }, o);
+  }
+  
+  auto VisitObjCIvarDecl(clang::ObjCIvarDecl* o) -> bool
+  {
+    // TODO: do the same logic as for properties
+    return visit([](clang::ObjCIvarDecl*) {
+        //llvm::outs() << "visiting ivar decl " << o->getName() << '\n';
+        return true;
+    }, o);
+  }
+ 
+  auto VisitObjCPropertyDecl(clang::ObjCPropertyDecl* o) -> bool
+  {
+    //llvm::outs() << "Visiting property " << o->getName() << '\n';
+    
+    // Annotated properties from project headers are handled as well, as long as
+    // no other translation unit importing the same header has already done it
+    return visitInProject([this](clang::ObjCPropertyDecl *o) {
+      const auto typeInfo = o->getTypeSourceInfo();
+      const auto type = typeInfo->getType().getTypePtrOrNull();
+    
+      auto objcObjectType = llvm::dyn_cast<clang::ObjCObjectPointerType>(type);
+    
+      // Only properties of objc types can provide...
+      // TODO: emit error in case properties of other types try to provide something
+      if (objcObjectType == nullptr) {
+        return true;
+      }
+      
+      //llvm::outs() << "Found a object property!!! " << objcObjectType->getTypeClassName()
+      //             << ":" << o->getName() << '\n';
+
+      auto provideAnnotationAttrs = std::vector<clang::AnnotateAttr*>{};
+
+      // I know, I know, but copy_if does not cast, so a simple for does the job
+      for (auto& attr: o->getAttrs()) {
+        auto annotateAttr = llvm::dyn_cast<clang::AnnotateAttr>(attr);
+
+        if (annotateAttr != nullptr && annotateAttr->getAnnotation().startswith(PROVIDE_TAG)) {
+          provideAnnotationAttrs.push_back(annotateAttr);
+        }
+      }
+      
+      if (provideAnnotationAttrs.empty()) {
+        return true;
+      }
+      
+      auto category = GeneratedCategory{};
+      category.usr = generateUSR(o);
+      
+      if (!_generatedCategories.claim(_inputFilename, category.usr)) {
+        llvm::outs() << "Category for " << o->getName() << " was already generated, skipping it\n";
+        return true;
+      }
+      
+      category.semanticHash = computeSemanticHash(o, provideAnnotationAttrs);
+      category.origin = formatLocation(_compilerInstance->getSourceManager(), provideAnnotationAttrs.front()->getLocation());
+      
+      if (_options.previousManifest != nullptr) {
+        if (const auto previousCategory = _options.previousManifest->find(category.usr, category.semanticHash)) {
+          llvm::outs() << "Category for " << o->getName() << " did not change, reusing it\n";
+          
+          // The annotation might have moved without changing anything else
+          auto reusedCategory = *previousCategory;
+          reusedCategory.origin = category.origin;
+          
+          _generatedCategories.add(std::move(reusedCategory));
+          return true;
+        }
+      }
+      
+      auto isGenerated = false;
+      
+      {
+        llvm::raw_string_ostream headerStream{category.header};
+        llvm::raw_string_ostream implStream{category.implementation};
+        
+        auto context = CodeGeneratorContext{_compilerInstance, _inputFilename, headerStream, implStream,
+                                            _options.selectorUsage,
+                                            _options.lazyMethods ? &category.lazyMethods : nullptr,
+                                            &category.selectorKeys};
+        context.shareForwarders = _options.shareForwarders;
+        
+        isGenerated = generateExtension(o, context, provideAnnotationAttrs, _knownDeclarations, category);
+      }
+      
+      std::sort(std::begin(category.selectorKeys), std::end(category.selectorKeys));
+      
+      if (isGenerated) {
+        _generatedCategories.add(std::move(category));
+      }
+      
+      return true;
+    }, o);
+  }
+};
+
+// The headers of the Clang modules a translation unit loads, which its source manager does not read. System ones
+// count too, as a cache hit or a spliced manifest entry skips parsing, so the module cache never checks the SDK.
+struct ModuleInputCollector: public clang::DependencyCollector
+{
+  auto needSystemDependencies() -> bool final
+  {
+    return true;
+  }
+};
+
+struct ObjCASTConsumer: public clang::ASTConsumer
+{
+  KnownDeclarations _knownDeclarations;
+  ObjCVisitor _visitor;
+  std::shared_ptr<ModuleInputCollector> _moduleInputs;
+
+  // The module reader is created at the first import, so it is listened to from the start
+  ObjCASTConsumer(clang::CompilerInstance* compilerInstance,
+                  llvm::StringRef inputFilename,
+                  GenerationOptions options,
+                  GeneratedCategoryRegistry& generatedCategories):
+  _visitor(compilerInstance, inputFilename, options, generatedCategories, _knownDeclarations),
+  _moduleInputs(std::make_shared<ModuleInputCollector>())
+  {
+    compilerInstance->addDependencyCollector(_moduleInputs);
+  }
+
+  auto HandleTopLevelDecl(clang::DeclGroupRef declGroup) -> bool final
+  {
+    for (auto &b: declGroup) {
+      _visitor.TraverseDecl(b);
+    }
+    
+    return true;
+  }
+  
+  // Every file read by the translation unit or the modules it loads, apart from the main one, which might be only in memory
+  auto HandleTranslationUnit(clang::ASTContext& context) -> void final
+  {
+    const auto& sourceManager = context.getSourceManager();
+    const auto mainFile = sourceManager.getFileEntryForID(sourceManager.getMainFileID());
+    
+    auto dependencies = std::vector<std::string>{};
+    
+    for (auto it = sourceManager.fileinfo_begin(); it != sourceManager.fileinfo_end(); ++it) {
+      if (it->first == mainFile) {
+        continue;
+      }
+      
+      auto path = llvm::SmallString<256>{it->first->getName()};
+      llvm::sys::fs::make_absolute(path);
+      dependencies.push_back(path.str());
+    }
+    
+    for (const auto& moduleInput: _moduleInputs->getDependencies()) {
+      auto path = llvm::SmallString<256>{moduleInput};
+      llvm::sys::fs::make_absolute(path);
+      dependencies.push_back(path.str());
+    }
+    
+    std::sort(std::begin(dependencies), std::end(dependencies));
+    dependencies.erase(std::unique(std::begin(dependencies), std::end(dependencies)), std::end(dependencies));
+    
+    _visitor._generatedCategories.finish(_visitor._inputFilename, std::move(dependencies),
+                                         sourceManager.getDiagnostics().hasErrorOccurred());
+  }
+
+};
+
+// Records every selector the project sends, and to which class, for -strip-unused-forwarders
+struct SelectorUsageVisitor: public clang::RecursiveASTVisitor<SelectorUsageVisitor>
+{
+  SelectorUsage& _selectorUsage;
+  
+  SelectorUsageVisitor(SelectorUsage& selectorUsage):
+  _selectorUsage(selectorUsage)
+  {
+  }
+  
+  // The interface of a receiver of type Foo* or Foo, nullptr for id, Class and the like
+  static auto getInterface(clang::QualType type) -> const clang::ObjCInterfaceDecl*
+  {
+    if (type.isNull()) {
+      return nullptr;
+    }
+    
+    if (const auto pointerType = type->getAs<clang::ObjCObjectPointerType>()) {
+      return pointerType->getInterfaceDecl();
+    }
+    
+    if (const auto objectType = type->getAs<clang::ObjCObjectType>()) {
+      return objectType->getInterface();
+    }
+    
+    return nullptr;
+  }
+  
+  auto record(const clang::ObjCInterfaceDecl* receiver, bool isClassMethod, clang::Selector selector) -> void
+  {
+    const auto selectorKey = formatSelectorKey(isClassMethod, selector.getAsString());
+    
+    if (receiver == nullptr) {
+      _selectorUsage.anyReceiver.insert(selectorKey);
+      return;
+    }
+    
+    _selectorUsage.byReceiver[receiver->getName()].insert(selectorKey);
+  }
+  
+  auto VisitObjCInterfaceDecl(clang::ObjCInterfaceDecl* o) -> bool
+  {
+    if (!o->hasDefinition()) {
+      return true;
+    }
+    
+    if (const auto superClass = o->getSuperClass()) {
+      _selectorUsage.superClasses[o->getName()] = superClass->getName();
+    }
+    
+    return true;
+  }
+  
+  auto VisitObjCMessageExpr(clang::ObjCMessageExpr* e) -> bool
+  {
+    const auto receiverType = e->getReceiverType();
+    
+    // [someClass doSomething] with someClass of type Class is a class message to any class
+    const auto isClassObject = e->getReceiverKind() == clang::ObjCMessageExpr::Instance
+                            && (receiverType->isObjCClassType() || receiverType->isObjCQualifiedClassType());
+    
+    const auto isClassMessage = e->isClassMessage() || isClassObject;
+    const auto receiver = isClassObject ? nullptr : e->getReceiverInterface();
+    
+    record(receiver, isClassMessage, e->getSelector());
+    return true;
+  }
+  
+  auto VisitObjCPropertyRefExpr(clang::ObjCPropertyRefExpr* e) -> bool
+  {
+    const auto receiverType = [&]() -> clang::QualType {
+      if (e->isSuperReceiver()) {
+        return e->getSuperReceiverType();
+      }
+      
+      if (e->isObjectReceiver()) {
+        return e->getBase()->getType();
+      }
+      
+      return {};
+    }();
+    
+    const auto isClassObject = !receiverType.isNull()
+                            && (receiverType->isObjCClassType() || receiverType->isObjCQualifiedClassType());
+    
+    const auto receiver = e->isClassReceiver() ? e->getClassReceiver() : getInterface(receiverType);
+    
+    const auto isClassMessage = e->isClassReceiver()
+                             || isClassObject
+                             || (e->isSuperReceiver() && receiverType->getAs<clang::ObjCObjectPointerType>() == nullptr);
+    
+    // Compound assignments like object.count += 1 use both accessors
+    if (e->isMessagingGetter()) {
+      record(isClassObject ? nullptr : receiver, isClassMessage, e->getGetterSelector());
+    }
+    
+    if (e->isMessagingSetter()) {
+      record(isClassObject ? nullptr : receiver, isClassMessage, e->getSetterSelector());
+    }
+    
+    return true;
+  }
+  
+  // Nothing is known about who performs an @selector(), nor if it is a class or instance method
+  auto VisitObjCSelectorExpr(clang::ObjCSelectorExpr* e) -> bool
+  {
+    record(nullptr, false, e->getSelector());
+    record(nullptr, true, e->getSelector());
+    return true;
+  }
+};
+
+struct SelectorUsageASTConsumer: public clang::ASTConsumer
+{
+  SelectorUsageVisitor _visitor;
+  
+  SelectorUsageASTConsumer(SelectorUsage& selectorUsage):
+  _visitor(selectorUsage)
+  {
+  }
+  
+  // Headers included, as call sites in inline functions and superclasses from frameworks count too
+  auto HandleTranslationUnit(clang::ASTContext& context) -> void final
+  {
+    _visitor.TraverseDecl(context.getTranslationUnitDecl());
+  }
+};
+
+namespace {
+  llvm::cl::OptionCategory commandLineCategory{"Mixin With Steroids Options"};
+  
+  llvm::cl::opt<std::string> headerFilename{"header-file",
+    llvm::cl::desc("Generated header file"),
+    llvm::cl::cat(commandLineCategory)};
+    
+  llvm::cl::opt<std::string> implementationFilename{"implementation-file",
+    llvm::cl::desc("Generated implementation file"),
+    llvm::cl::cat(commandLineCategory)};
+    
+  llvm::cl::opt<bool> stripUnusedForwarders{"strip-unused-forwarders",
+    llvm::cl::desc("Do not generate forwarders which are never called on their host classes. "
+                   "Selectors only performed dynamically (e.g. from strings) are not detected!"),
+    llvm::cl::cat(commandLineCategory)};
+    
+  llvm::cl::list<std::string> usageSourceList{"usage-source",
+    llvm::cl::desc("Additional source file analysed for call sites by -strip-unused-forwarders"),
+    llvm::cl::cat(commandLineCategory)};
+    
+  llvm::cl::opt<bool> umbrellaParse{"umbrella",
+    llvm::cl::desc("Parse all the source files with the same compile flags at once, "
+                   "in a single translation unit importing all of them. The files of an umbrella with errors, "
+                   "e.g. static functions with the same name, are parsed one by one again"),
+    llvm::cl::cat(commandLineCategory)};
+    
+  llvm::cl::opt<std::string> moduleCachePath{"module-cache-path",
+    llvm::cl::desc("Directory where the Clang modules built for imports like <Foundation/Foundation.h> are kept, "
+                   "to be reused by the next translation units and runs"),
+    llvm::cl::cat(commandLineCategory)};
+    
+  llvm::cl::opt<std::string> cacheDirectory{"cache-dir",
+    llvm::cl::desc("Directory, possibly shared by many machines, caching the categories generated for each "
+                   "translation unit, so unchanged ones are not parsed again. Entries written by another user "
+                   "are written again when used, as only their owner can update their last use"),
+    llvm::cl::cat(commandLineCategory)};
+    
+  llvm::cl::opt<std::string> cacheBaseDirectory{"cache-base-dir",
+    llvm::cl::desc("Directory, usually the root of the checkout, whose paths are made relative in the cache keys "
+                   "and entries, so that machines building in different directories share the cache"),
+    llvm::cl::cat(commandLineCategory)};
+    
+  llvm::cl::opt<unsigned> cacheMaxSize{"cache-max-size",
+    llvm::cl::desc("Maximum size of the cache directory in megabytes, the least recently used entries are evicted first"),
+    llvm::cl::init(1024),
+    llvm::cl::cat(commandLineCategory)};
+    
+  llvm::cl::opt<std::string> incrementalManifestPath{"incremental-manifest",
+    llvm::cl::desc("File recording what each translation unit and category was generated from, so that the next "
+                   "run only parses and generates again what changed"),
+    llvm::cl::cat(commandLineCategory)};
+    
+  llvm::cl::opt<bool> lazyMethods{"lazy-methods",
+    llvm::cl::desc("Generate forwarders as functions installed by +resolveInstanceMethod: and +resolveClassMethod: "
+                   "the first time they are called, instead of registering all of them at launch. "
+                   "Host classes must not implement these methods themselves"),
+    llvm::cl::cat(commandLineCategory)};
+    
+  llvm::cl::opt<bool> shareForwarders{"share-forwarders",
+    llvm::cl::desc("Along with -lazy-methods, which it requires, generate a single function for the forwarders of all the host classes which "
+                   "only differ in the property they read, instead of one per host"),
+    llvm::cl::cat(commandLineCategory)};
+    
+  llvm::cl::list<std::string> configurationList{"configuration",
+    llvm::cl::desc("Generate for this configuration too, as <condition>;<argument>;... e.g. \"defined(__x86_64__);-arch;x86_64\". "
+                   "The arguments are added to every compile command, and categories which differ between configurations "
+                   "are guarded by their conditions in the output"),
+    llvm::cl::cat(commandLineCategory)};
+    
+  llvm::cl::opt<bool> coalesceCategories{"coalesce-categories",
+    llvm::cl::desc("Generate a single category per host class with the members provided by all its properties, "
+                   "instead of one category per property"),
+    llvm::cl::cat(commandLineCategory)};
+    
+  llvm::cl::opt<bool> validateOutput{"validate",
+    llvm::cl::desc("Parse the generated code right after writing it, for every configuration, "
+                   "reporting its errors at the PROVIDE annotations they come from"),
+    llvm::cl::cat(commandLineCategory)};
+    
+  // FIXME: this is a huge workaround for not being able to get all the files passed on the command line
+  std::vector<std::string> sourcePathList;
+  
+  SelectorUsage selectorUsage;
+  GeneratedCategoryRegistry generatedCategories;
+  IncrementalManifest previousManifest;
+  
+  // Absolute paths of the translation units of the last run of a tool which had errors
+  std::set<std::string> translationUnitsWithErrors;
+}
+
+auto recordErrors(const clang::FrontendAction& action) -> void
+{
+  if (action.getCompilerInstance().getDiagnostics().hasErrorOccurred()) {
+    auto path = llvm::SmallString<256>{action.getCurrentFile()};
+    llvm::sys::fs::make_absolute(path);
+    translationUnitsWithErrors.insert(path.str());
+  }
+}
+
+struct SelectorUsageFrontendAction: public clang::ASTFrontendAction
+{
+  auto CreateASTConsumer(clang::CompilerInstance&, llvm::StringRef) -> std::unique_ptr<clang::ASTConsumer> final
+  {
+    return llvm::make_unique<SelectorUsageASTConsumer>(selectorUsage);
+  }
+  
+  auto EndSourceFileAction() -> void final
+  {
+    recordErrors(*this);
+  }
+};
+
+// For each source file provided to the tool, a new FrontendAction is created.
+struct MyFrontendAction: public clang::ASTFrontendAction
+{
+  MyFrontendAction()
+  {
+  }
+  
+  virtual ~MyFrontendAction()
+  {
+  }
+  
+  auto CreateASTConsumer(clang::CompilerInstance& compilerInstance, llvm::StringRef file) -> std::unique_ptr<clang::ASTConsumer> final
+  {
+    // The tool runs each translation unit in the directory of its compile command
+    auto absoluteFile = llvm::SmallString<256>{file};
+    llvm::sys::fs::make_absolute(absoluteFile);
+    
+    auto options = GenerationOptions{};
+    options.selectorUsage = stripUnusedForwarders ? &selectorUsage : nullptr;
+    options.previousManifest = incrementalManifestPath.empty() ? nullptr : &previousManifest;
+    options.lazyMethods = lazyMethods;
+    options.shareForwarders = shareForwarders;
+    
+    return llvm::make_unique<ObjCASTConsumer>(&compilerInstance, absoluteFile, options, generatedCategories);
+  }
+  
+  auto EndSourceFileAction() -> void final
+  {
+    recordErrors(*this);
+  }
+};
+
+// A translation unit which only exists in memory, importing several source files
+struct UmbrellaTranslationUnit
+{
+  std::string path;
+  std::string contents;
+  clang::tooling::CompileCommand command;
+  std::vector<std::string> files;
+};
+
+// Answers with the umbrella compile commands, and with the ones from the real database for everything else
+struct UmbrellaCompilationDatabase: public clang::tooling::CompilationDatabase
+{
+  const clang::tooling::CompilationDatabase& _compilations;
+  const std::vector<UmbrellaTranslationUnit>& _umbrellas;
+  
+  UmbrellaCompilationDatabase(const clang::tooling::CompilationDatabase& compilations,
+                              const std::vector<UmbrellaTranslationUnit>& umbrellas):
+  _compilations(compilations),
+  _umbrellas(umbrellas)
+  {
+  }
+  
+  auto getCompileCommands(llvm::StringRef filePath) const -> std::vector<clang::tooling::CompileCommand> final
+  {
+    const auto it = std::find_if(std::begin(_umbrellas), std::end(_umbrellas), [=](const UmbrellaTranslationUnit& umbrella) {
+      return umbrella.path == filePath;
+    });
+    
+    if (it != std::end(_umbrellas)) {
+      return {it->command};
+    }
+    
+    return _compilations.getCompileCommands(filePath);
   }
   
-  template<
-    typename Result,
-    typename Filter,
-    typename InterfaceExtractor,
-    typename CategoryExtractor, 
-    typename ProtocolExtractor>
-  auto getMemberForObjectType(const clang::ObjCObjectPointerType* pointerType,
-                       Filter filter,
-                       InterfaceExtractor interfaceExtractor,
-                       CategoryExtractor categoryExtractor,
-                       ProtocolExtractor protocolExtractor) -> Result
+  auto getAllFiles() const -> std::vector<std::string> final
   {
-    const auto type = pointerType->getObjectType();
+    return _compilations.getAllFiles();
+  }
+  
+  auto getAllCompileCommands() const -> std::vector<clang::tooling::CompileCommand> final
+  {
+    return _compilations.getAllCompileCommands();
+  }
+};
+
+auto isSameFile(const clang::tooling::CompileCommand& command, llvm::StringRef argument, llvm::StringRef file) -> bool
+{
+  if (argument == file) {
+    return true;
+  }
+  
+  if (llvm::sys::path::is_absolute(argument)) {
+    return false;
+  }
+  
+  auto absoluteArgument = llvm::SmallString<256>{command.Directory};
+  llvm::sys::path::append(absoluteArgument, argument);
+  
+  return absoluteArgument.str() == file;
+}
+
+// Removes the arguments naming where the outputs of a file go, which differ between files compiled the same way
+auto stripPerFileOutputArguments(const std::vector<std::string>& arguments) -> std::vector<std::string>
+{
+  static const auto separateOptions = std::set<std::string>{
+    "-o", "-MF", "-MT", "-MQ", "-dependency-file", "--serialize-diagnostics", "-serialize-diagnostic-file", "-index-store-path"
+  };
+  static const auto joinedOptions = {"-MF", "-MT", "-MQ", "--serialize-diagnostics=", "-index-store-path="};
+  
+  auto strippedArguments = std::vector<std::string>{};
+  
+  for (auto it = std::begin(arguments), end = std::end(arguments); it != end; ++it) {
+    if (separateOptions.count(*it) > 0 && std::next(it) != end) {
+      ++it;
+      continue;
+    }
     
-    llvm::outs() << "Dumping type \n";
-    type->dump();
+    const auto isJoined = std::any_of(std::begin(joinedOptions), std::end(joinedOptions), [&](const char* option) {
+      return llvm::StringRef{*it}.startswith(option) && *it != option;
+    });
     
-    const auto resultInInterface = [=] {
-      if (const auto interfaceType = llvm::dyn_cast<clang::ObjCInterfaceType>(type)) {
-        return getMemberForObjectInterfaceType<Result>(interfaceType, filter, interfaceExtractor, categoryExtractor, protocolExtractor);
-      }
+    if (!isJoined) {
+      strippedArguments.push_back(*it);
+    }
+  }
+  
+  return strippedArguments;
+}
 
-      return Result();
-    }();
+// The flags used for compiling a file, without the file itself or where its outputs go
+auto getFlagsKey(const clang::tooling::CompileCommand& command, llvm::StringRef file) -> std::string
+{
+  auto key = command.Directory;
+  
+  for (const auto& argument: stripPerFileOutputArguments(command.CommandLine)) {
+    if (!isSameFile(command, argument, file)) {
+      key += '\0' + argument;
+    }
+  }
+  
+  return key;
+}
+
+// Files with exactly the same flags are imported by a single umbrella translation unit, so their common headers
+// are parsed once. Files which do not share their flags with any other keep being parsed on their own, and so are
+// the files of an umbrella with errors, see runTool in main.
+auto groupInUmbrellas(const clang::tooling::CompilationDatabase& compilations,
+                      const std::vector<std::string>& sourcePaths,
+                      std::vector<std::string>& singleSourcePaths) -> std::vector<UmbrellaTranslationUnit>
+{
+  struct Group
+  {
+    clang::tooling::CompileCommand command;
+    std::string file;
+    std::vector<std::string> files;
+  };
+  
+  auto groups = std::map<std::string, Group>{};
+  auto groupOrder = std::vector<std::string>{};
+  
+  for (const auto& sourcePath: sourcePaths) {
+    auto file = llvm::SmallString<256>{sourcePath};
+    llvm::sys::fs::make_absolute(file);
     
-    if (resultInInterface != nullptr) {
-      return resultInInterface;
+    const auto commands = compilations.getCompileCommands(file);
+    
+    // A file compiled in several different ways is a conflict on its own
+    if (commands.size() != 1) {
+      singleSourcePaths.push_back(sourcePath);
+      continue;
     }
     
-    assert(!type->isObjCClass() && "FIXME: Sorry, not support for properties of type Class yet :-(");
-   
-    // Could not find anything in the property interface type or any of its extensions or protocols.
-    // Let's now look at the protocols specified in the property type
-    // e.g: in `@property NSString<Prot1, Prot2>* prop;` look at Prot1 and Prot2
-    for (auto i = 0u, numberOfProtocols = pointerType->getNumProtocols(); i < numberOfProtocols; i++) {
-      const auto protocol = pointerType->getProtocol(i);
-      
-      // FIXME: this is copy&paste from above
-      const auto membersInProtocol = protocolExtractor(protocol);
-      
-      const auto it = std::find_if(membersInProtocol.begin(), membersInProtocol.end(), filter);
-      
-      if (it != membersInProtocol.end()) {
-        return *it;
+    const auto key = getFlagsKey(commands.front(), file);
+    
+    if (groups.count(key) == 0) {
+      groups[key] = Group{commands.front(), file.str(), {}};
+      groupOrder.push_back(key);
+    }
+    
+    groups[key].files.push_back(file.str());
+  }
+  
+  auto umbrellas = std::vector<UmbrellaTranslationUnit>{};
+  
+  for (const auto& key: groupOrder) {
+    const auto& group = groups[key];
+    
+    if (group.files.size() == 1) {
+      singleSourcePaths.push_back(group.files.front());
+      continue;
+    }
+    
+    auto umbrella = UmbrellaTranslationUnit{};
+    
+    // Compared to the absolute paths the tool gives to translation units, while a fixed compilation database has "." as directory
+    auto path = llvm::SmallString<256>{group.command.Directory};
+    llvm::sys::path::append(path, llvm::formatv(umbrellaFilenameFormat, umbrellas.size()).str());
+    llvm::sys::fs::make_absolute(path);
+    llvm::sys::path::remove_dots(path, true);
+    umbrella.path = path.str();
+    
+    for (const auto& file: group.files) {
+      umbrella.contents += llvm::formatv(objCImportFileFormat, file);
+    }
+    
+    umbrella.files = group.files;
+    umbrella.command = group.command;
+    umbrella.command.Filename = umbrella.path;
+    // Otherwise the umbrella would write the dependencies or diagnostics of the first file
+    umbrella.command.CommandLine = stripPerFileOutputArguments(group.command.CommandLine);
+    
+    for (auto& argument: umbrella.command.CommandLine) {
+      if (isSameFile(group.command, argument, group.file)) {
+        argument = umbrella.path;
       }
     }
     
-    return nullptr;
+    llvm::outs() << "Umbrella " << umbrella.path << " imports " << group.files.size() << " files\n";
+    
+    umbrellas.push_back(std::move(umbrella));
   }
   
-  template<typename Extractor>
-  auto getSelectorForInterface(const clang::ObjCObjectPointerType* type, const StringRef selectorName, Extractor extractor) -> clang::ObjCMethodDecl*
+  return umbrellas;
+}
+
+// ccache-like cache of the categories each translation unit generates. Entries are keyed by the tool binary,
+// the output options, the compile commands and the main file contents, and are valid while all the files the translation unit
+// read keep the same contents. A hit skips parsing, resolving and generating code for the translation unit.
+struct OutputCache
+{
+  std::string _directory;
+  std::string _baseDirectory;
+  
+  unsigned hits = 0;
+  unsigned misses = 0;
+  
+  OutputCache(llvm::StringRef directory, llvm::StringRef baseDirectory):
+  _directory(directory),
+  _baseDirectory(baseDirectory)
   {
-    const auto filter = [=](const clang::ObjCMethodDecl* methodDecl) {
-      llvm::outs() << "Comparing " << methodDecl->getSelector().getAsString() << " with " << selectorName << '\n';
-      return methodDecl->getSelector().getAsString() == selectorName;
-    };
-    
-    return getMemberForObjectType<clang::ObjCMethodDecl*>(type, filter, extractor, extractor, extractor);
+    llvm::sys::fs::create_directories(_directory);
   }
   
-  auto getInstanceSelectorForObjectType(const clang::ObjCObjectPointerType* type, const StringRef selectorName) -> clang::ObjCMethodDecl*
+  auto getEntryPath(llvm::StringRef key) const -> std::string
   {
-    const auto extractor = [](const clang::ObjCContainerDecl* container) {
-      return container->instance_methods();
-    };
+    auto path = llvm::SmallString<256>{_directory};
+    llvm::sys::path::append(path, llvm::formatv(cacheEntryFilenameFormat, key).str());
+    return path.str();
+  }
+  
+  // On a hit, the cached categories are registered as if the translation unit was just parsed
+  auto lookup(llvm::StringRef key, const std::string& translationUnit, GeneratedCategoryRegistry& registry) -> bool
+  {
+    const auto isHit = [&] {
+      const auto path = getEntryPath(key);
+      const auto buffer = llvm::MemoryBuffer::getFile(path);
+      
+      if (!buffer) {
+        return false;
+      }
+      
+      auto contents = (*buffer)->getBuffer();
+      auto field = std::string{};
+      auto dependencies = std::vector<std::string>{};
+      auto isUnchanged = false;
+      auto count = size_t{};
+      
+      if (!readCacheField(contents, field) || field != cacheFormatVersion
+          || !readDependencies(contents, dependencies, isUnchanged, _baseDirectory) || !isUnchanged
+          || !readCacheCount(contents, count)) {
+        return false;
+      }
+      
+      auto categories = std::vector<GeneratedCategory>(count);
+      
+      for (auto& category: categories) {
+        if (!readCategory(contents, category)) {
+          return false;
+        }
+      }
+      
+      for (auto& category: categories) {
+        if (registry.claim(translationUnit, category.usr)) {
+          registry.add(std::move(category));
+        }
+      }
+      
+      registry.finish(translationUnit, std::move(dependencies), false);
+      
+      touch(path, (*buffer)->getBuffer());
+      
+      return true;
+    }();
     
-    return getSelectorForInterface(type, selectorName, extractor);
+    (isHit ? hits : misses)++;
+    
+    return isHit;
   }
   
-  auto getClassSelectorForObjectType(const clang::ObjCObjectPointerType* type, const StringRef selectorName) -> clang::ObjCMethodDecl*
+  auto store(llvm::StringRef key, const TranslationUnitRecord& record, const GeneratedCategoryRegistry& registry) const -> void
   {
-    const auto extractor = [](const clang::ObjCContainerDecl* container) {
-      return container->class_methods();
-    };
+    if (record.hasErrors) {
+      return;
+    }
     
-    return getSelectorForInterface(type, selectorName, extractor);
+    auto contents = std::string{};
+    
+    {
+      llvm::raw_string_ostream stream{contents};
+      
+      writeCacheField(stream, cacheFormatVersion);
+      writeDependencies(stream, record.dependencies, _baseDirectory);
+      
+      // Categories claimed by the translation unit but with nothing to provide are not in the registry
+      auto categories = std::vector<const GeneratedCategory*>{};
+      
+      for (const auto& usr: record.categoryUSRs) {
+        const auto it = registry.categories.find(usr);
+        
+        if (it != registry.categories.end()) {
+          categories.push_back(&it->second);
+        }
+      }
+      
+      writeCacheField(stream, std::to_string(categories.size()));
+      
+      for (const auto category: categories) {
+        writeCategory(stream, *category);
+      }
+    }
+    
+    write(getEntryPath(key), contents);
   }
   
-  template<typename Extractor>
-  auto getPropertyForObjectType(const clang::ObjCObjectPointerType* type, const StringRef propertyName, Extractor extractor) -> clang::ObjCPropertyDecl*
+  // Entries are written to a temporary file first, as other machines might be reading the same directory
+  auto write(llvm::StringRef path, llvm::StringRef contents) const -> void
   {
-    const auto filter = [=](const clang::ObjCPropertyDecl* propertyDecl) {
-      llvm::outs() << "comparing " << propertyDecl->getName() << " with " << propertyName << '\n';
-      return propertyDecl->getName() == propertyName;
-    };
+    auto fd = int{};
+    auto temporaryPathModel = llvm::SmallString<256>{_directory};
+    llvm::sys::path::append(temporaryPathModel, cacheTemporaryFilenameModel);
     
-    return getMemberForObjectType<clang::ObjCPropertyDecl*>(type, filter, extractor, extractor, extractor);
+    auto temporaryPath = llvm::SmallString<256>{};
+    
+    if (llvm::sys::fs::createUniqueFile(temporaryPathModel, fd, temporaryPath)) {
+      return;
+    }
+    
+    {
+      llvm::raw_fd_ostream stream{fd, true};
+      stream << contents;
+    }
+    
+    if (llvm::sys::fs::rename(temporaryPath, path)) {
+      llvm::sys::fs::remove(temporaryPath);
+    }
   }
   
-  auto getInstancePropertyForObjectType(const clang::ObjCObjectPointerType* type, const StringRef propertyName) -> clang::ObjCPropertyDecl*
+  // The modification time of an entry is the last time it was used. Only the owner of a file can set it, so an
+  // entry written by another user, e.g. another CI worker sharing the directory over NFS, is written again instead
+  auto touch(llvm::StringRef path, llvm::StringRef contents) const -> void
   {
-    const auto extractor = [](const clang::ObjCContainerDecl* container) {
-      return container->instance_properties();
-    };
+    auto fd = int{};
     
-    return getPropertyForObjectType(type, propertyName, extractor);
+    if (!llvm::sys::fs::openFileForRead(path, fd)) {
+      const auto error = llvm::sys::fs::setLastModificationAndAccessTime(fd, std::chrono::system_clock::now());
+      llvm::sys::Process::SafelyCloseFileDescriptor(fd);
+      
+      if (!error) {
+        return;
+      }
+    }
+    
+    write(path, contents);
   }
   
-  auto getClassPropertyForObjectType(const clang::ObjCObjectPointerType* type, const StringRef propertyName) -> clang::ObjCPropertyDecl*
+  auto evict(uint64_t maxSize) const -> void
   {
-    const auto extractor = [](const clang::ObjCContainerDecl* container) {
-      return container->class_properties();
+    struct Entry
+    {
+      std::string path;
+      uint64_t size;
+      llvm::sys::TimePoint<> lastUse;
     };
     
-    return getPropertyForObjectType(type, propertyName, extractor);
+    auto entries = std::vector<Entry>{};
+    auto totalSize = uint64_t{};
+    
+    auto error = std::error_code{};
+    
+    for (auto it = llvm::sys::fs::directory_iterator{_directory, error}; !error && it != llvm::sys::fs::directory_iterator{}; it.increment(error)) {
+      auto status = llvm::sys::fs::file_status{};
+      
+      if (llvm::sys::path::extension(it->path()) != ".entry" || llvm::sys::fs::status(it->path(), status)) {
+        continue;
+      }
+      
+      entries.push_back({it->path(), status.getSize(), status.getLastModificationTime()});
+      totalSize += status.getSize();
+    }
+    
+    std::sort(std::begin(entries), std::end(entries), [](const Entry& a, const Entry& b) {
+      return a.lastUse < b.lastUse;
+    });
+    
+    for (auto it = std::begin(entries); totalSize > maxSize && it != std::end(entries); ++it) {
+      if (!llvm::sys::fs::remove(it->path)) {
+        totalSize -= it->size;
+      }
+    }
   }
+};
+
+// Identifies the tool build by the contents of its binary, as any change in the tool can change the generated code,
+// but not by its path or modification time, so the same build installed on several machines shares the cache.
+// Hashing a statically linked binary reads tens of megabytes, so the hash is kept in the cache for the next runs.
+// Without a cache, only the local manifest uses the identity, for which the binary's status is enough.
+auto getToolIdentity(const char* argv0, const OutputCache* cache) -> std::string
+{
+  const auto executable = llvm::sys::fs::getMainExecutable(argv0, reinterpret_cast<void*>(&getToolIdentity));
   
-  auto generateCallBody(clang::ObjCMethodDecl* selectorInProperty) -> std::string
-  {
-     const auto selectorNameAsStdString = selectorInProperty->getSelector().getAsString();
-          
-     if (selectorInProperty->getSelector().getNumArgs() == 0) {
-       return selectorNameAsStdString;
-     }
-     
-     // yep, it's a view of the std::string version. Not so fancy, but works
-     const auto selectorName = llvm::StringRef{selectorNameAsStdString};
-     
-     const auto parameters = selectorInProperty->parameters();
+  auto status = llvm::sys::fs::file_status{};
+  
+  if (llvm::sys::fs::status(executable, status)) {
+    return executable;
+  }
+  
+  const auto localIdentity = llvm::formatv("{0}:{1}:{2}", executable, status.getSize(), status.getLastModificationTime().time_since_epoch().count()).str();
+  
+  if (cache == nullptr) {
+    return localIdentity;
+  }
+  
+  auto memoPath = llvm::SmallString<256>{cache->_directory};
+  llvm::sys::path::append(memoPath, llvm::formatv(cacheToolIdentityFilenameFormat, hashString(localIdentity)).str());
+  
+  if (const auto buffer = llvm::MemoryBuffer::getFile(memoPath)) {
+    return (*buffer)->getBuffer();
+  }
+  
+  const auto hash = hashFile(executable);
+  
+  if (hash.empty()) {
+    return localIdentity;
+  }
+  
+  cache->write(memoPath, hash);
+  
+  return hash;
+}
 
-     auto paramLabels = llvm::SmallVector<llvm::StringRef, 10>{};
-     selectorName.split(paramLabels, ":", -1, false);
+// Everything which is not in the translation unit but still changes the categories it generates
+auto getOutputOptionsKey() -> std::string
+{
+  auto key = std::string{stripUnusedForwarders ? "strip-unused-forwarders" : ""};
+  key += lazyMethods ? "\1lazy-methods" : "";
+  key += shareForwarders ? "\1share-forwarders" : "";
+  
+  // Call sites of the whole project decide what is stripped
+  if (stripUnusedForwarders) {
+    for (const auto& selector: selectorUsage.anyReceiver) {
+      key += '\0' + selector;
+    }
+    
+    for (const auto& receiver: selectorUsage.byReceiver) {
+      key += '\0' + receiver.first;
+      
+      for (const auto& selector: receiver.second) {
+        key += '\1' + selector;
+      }
+    }
+    
+    for (const auto& superClass: selectorUsage.superClasses) {
+      key += '\0' + superClass.first + '\1' + superClass.second;
+    }
+  }
+  
+  return key;
+}
 
-     // TODO: use stream instead
-     auto callBody = std::string{};
+// A way the sources are built, e.g. for an architecture, with the condition telling it apart in the output
+struct Configuration
+{
+  std::string condition;
+  clang::tooling::CommandLineArguments arguments;
+};
 
-     // FIXME: it fails for methods with no arguments!
-     assert(paramLabels.size() == parameters.size());
+// Empty fields are kept, so that ";-arch;x86_64" is an error rather than a configuration with "-arch" as condition
+auto parseConfiguration(llvm::StringRef value, Configuration& configuration) -> bool
+{
+  auto fields = llvm::SmallVector<llvm::StringRef, 8>{};
+  value.split(fields, ";", -1, true);
+  
+  configuration.condition = fields.front().trim().str();
+  
+  if (configuration.condition.empty()) {
+    llvm::errs() << "error: configuration \"" << value << "\" has no condition, it must be <condition>;<argument>;...\n";
+    return false;
+  }
+  
+  for (const auto argument: llvm::makeArrayRef(fields).drop_front()) {
+    if (!argument.empty()) {
+      configuration.arguments.push_back(argument.str());
+    }
+  }
+  
+  return true;
+}
 
-     for (size_t size = parameters.size(), i = 0u; i < size; i++) {
-       callBody += paramLabels[i];
-       callBody += ":";
-       callBody += parameters[i]->getName();
-       if (i < size - 1) {
-         callBody += " ";
-       }
-       llvm::outs() << paramLabels[i] << ":" << parameters[i]->getName() << " " << "\n";
-     }
+auto formatConfigurationsCondition(const std::vector<Configuration>& configurations, const std::vector<size_t>& indexes) -> std::string
+{
+  auto condition = std::string{};
+  
+  for (const auto index: indexes) {
+    condition += (condition.empty() ? "(" : " || (") + configurations[index].condition + ")";
+  }
+  
+  return condition;
+}
 
-     return callBody;
+auto isSameOutput(const GeneratedCategory& lhs, const GeneratedCategory& rhs) -> bool
+{
+  const auto isSameLazyMethod = [](const LazyMethod& lhs, const LazyMethod& rhs) {
+    return lhs.isClassMethod == rhs.isClassMethod
+        && lhs.selector == rhs.selector
+        && lhs.functionName == rhs.functionName
+        && lhs.typeEncoding == rhs.typeEncoding
+        && lhs.accessor == rhs.accessor
+        && lhs.sharedDefinition == rhs.sharedDefinition;
+  };
+  
+  return lhs.hostName == rhs.hostName
+      && lhs.typeName == rhs.typeName
+      && lhs.propertyName == rhs.propertyName
+      && lhs.header == rhs.header
+      && lhs.implementation == rhs.implementation
+      && lhs.selectorKeys == rhs.selectorKeys
+      && lhs.lazyMethods.size() == rhs.lazyMethods.size()
+      && std::equal(std::begin(lhs.lazyMethods), std::end(lhs.lazyMethods), std::begin(rhs.lazyMethods), isSameLazyMethod);
+}
+
+// Categories generated the same way by all the configurations are written once, as they are. Each different
+// version of the others is guarded by the conditions of the configurations generating it.
+auto mergeConfigurations(const std::vector<Configuration>& configurations,
+                         std::vector<std::map<std::string, GeneratedCategory>>& configurationCategories)
+  -> std::map<std::string, GeneratedCategory>
+{
+  if (configurationCategories.size() == 1) {
+    return std::move(configurationCategories.front());
   }
   
-  auto generateSelectorDefinition(clang::ObjCMethodDecl* selectorInProperty,
-                                  const std::string& selectorSignature,
-                                  const std::string& memberTODORenameMeForSomethingThatRefersToClassToo) -> std::string
-  {
-    return llvm::formatv(objCSelectorImplementationFormat,
-                         selectorSignature,
-                         memberTODORenameMeForSomethingThatRefersToClassToo,
-                         generateCallBody(selectorInProperty));
+  auto usrs = std::set<std::string>{};
+  
+  for (const auto& categories: configurationCategories) {
+    for (const auto& entry: categories) {
+      usrs.insert(entry.first);
+    }
   }
   
-  auto generateSelectorSignature(clang::ObjCMethodDecl* selector) -> std::string
-  {
-    const auto returnType = selector->getReturnType();
+  auto merged = std::map<std::string, GeneratedCategory>{};
+  
+  for (const auto& usr: usrs) {
+    // Each different version, with the configurations generating it
+    auto versions = std::vector<std::pair<const GeneratedCategory*, std::vector<size_t>>>{};
     
-    const auto signatureCore = [&]() -> std::string {
-      const auto parameters = selector->parameters();
-      
-      // FIXME: this is copy@paste
-      const auto selectorNameAsStdString = selector->getSelector().getAsString();
+    for (auto i = size_t{}; i < configurationCategories.size(); i++) {
+      const auto category = configurationCategories[i].find(usr);
       
-      llvm::outs() << "analysing selector " << selector->getSelector().getAsString() << '\n';
-      
-      if (parameters.empty()) {
-        return selectorNameAsStdString;
+      if (category == configurationCategories[i].end()) {
+        continue;
       }
       
-      const auto selectorName = llvm::StringRef{selectorNameAsStdString.data(), selectorNameAsStdString.size()};
-      
-      auto paramLabels = llvm::SmallVector<llvm::StringRef, 10>{};
-      selectorName.split(paramLabels, ":", -1, false);
-
-      // FIXME: this is copy&paste code
+      const auto version = std::find_if(std::begin(versions), std::end(versions), [&](const std::pair<const GeneratedCategory*, std::vector<size_t>>& version) {
+        return isSameOutput(*version.first, category->second);
+      });
       
-      // TODO: use stream instead
-      auto callBody = std::string{};
-
-      // FIXME: it fails for methods with no arguments!
-      assert(paramLabels.size() == parameters.size());
-
-      for (size_t size = parameters.size(), i = 0u; i < size; i++) {
-        callBody += llvm::formatv("{0}:({1}){2} ", paramLabels[i], parameters[i]->getType().getAsString(), parameters[i]->getName());
+      if (version != std::end(versions)) {
+        version->second.push_back(i);
       }
-      
-      return callBody;
-    }();
+      else {
+        versions.push_back({&category->second, {i}});
+      }
+    }
     
-    const auto methodType = selector->isClassMethod() ? "+" : "-";
+    if (versions.size() == 1 && versions.front().second.size() == configurations.size()) {
+      merged[usr] = *versions.front().first;
+      continue;
+    }
     
-    return llvm::formatv(objCSelectorSignatureFormat, methodType, returnType.getAsString(), signatureCore);
-  }
+    llvm::outs() << "Category " << usr << " differs between configurations, guarding its " << versions.size() << " versions\n";
     
-  auto getPropertyPointerType(clang::ObjCPropertyDecl* o)
+    for (auto i = size_t{}; i < versions.size(); i++) {
+      auto category = *versions[i].first;
+      category.condition = formatConfigurationsCondition(configurations, versions[i].second);
+      category.configurations = versions[i].second;
+      
+      // Versions sort right after each other
+      merged[usr + '\1' + std::to_string(i)] = std::move(category);
+    }
+  }
+  
+  return merged;
+}
+
+// Where each category was written in the output, to report errors in the generated code at their origin
+struct GeneratedCodeOrigins
+{
+  // Offset in the file where the code of a category, or of none, starts
+  using Offsets = std::map<uint64_t, const GeneratedCategory*>;
+  
+  static auto find(const Offsets& offsets, uint64_t offset) -> const GeneratedCategory*
   {
-    return llvm::dyn_cast<clang::ObjCObjectPointerType>(o->getTypeSourceInfo()->getType().getTypePtrOrNull());
+    const auto it = offsets.upper_bound(offset);
+    return it == offsets.begin() ? nullptr : std::prev(it)->second;
   }
   
-  auto formatObjectType(const clang::ObjCObjectType* type) -> std::string
+  Offsets header;
+  Offsets implementation;
+};
+
+// Code of a category in the output, guarded by preprocessor conditions when it is not in all configurations
+struct CategoryFragment
+{
+  CategoryFragment(llvm::raw_ostream& stream, GeneratedCodeOrigins::Offsets& offsets, const GeneratedCategory& category):
+    _stream(stream),
+    _offsets(offsets),
+    _condition(category.condition)
   {
-    // An interface with no protocols or generic types
-    if (const auto interfaceType = llvm::dyn_cast<clang::ObjCInterfaceType>(type)) {
-      return interfaceType->getDecl()->getName();
+    if (!_condition.empty()) {
+      _stream << llvm::formatv(objCConditionBeginFormat, _condition);
     }
     
-    const auto objType = llvm::dyn_cast<clang::ObjCObjectType>(type);
+    _offsets[_stream.tell()] = &category;
+  }
+  
+  ~CategoryFragment()
+  {
+    _offsets[_stream.tell()] = nullptr;
     
-    if (objType == nullptr) {
-      assert(false && "Unknown type!!!");
-      return "";
+    if (!_condition.empty()) {
+      _stream << objCConditionEnd;
     }
+  }
+  
+  llvm::raw_ostream& _stream;
+  GeneratedCodeOrigins::Offsets& _offsets;
+  llvm::StringRef _condition;
+};
+
+// Functions of all the categories, then for each host class the sorted tables its resolvers look selectors up in
+auto writeLazyMethods(llvm::raw_ostream& implStream,
+                      const std::map<std::string, GeneratedCategory>& categories,
+                      const std::vector<Configuration>& configurations,
+                      GeneratedCodeOrigins::Offsets& offsets) -> void
+{
+  implStream << objCLazyMethodRuntimeSupport;
+  
+  struct HostLazyMethod
+  {
+    const LazyMethod* method;
+    const GeneratedCategory* category;
+  };
+  
+  auto hostMethods = std::map<std::string, std::pair<std::vector<HostLazyMethod>, std::vector<HostLazyMethod>>>{};
+  // A shared definition is only compiled in the configurations of the categories using it
+  struct SharedDefinition
+  {
+    std::string definition;
+    bool isInAllConfigurations = false;
+    std::set<size_t> configurations;
+  };
+  
+  auto sharedDefinitions = std::map<std::string, SharedDefinition>{};
+  
+  for (const auto& entry: categories) {
+    for (const auto& lazyMethod: entry.second.lazyMethods) {
+      if (lazyMethod.sharedDefinition.empty()) {
+        continue;
+      }
+      
+      auto& sharedDefinition = sharedDefinitions[lazyMethod.functionName];
+      sharedDefinition.definition = lazyMethod.sharedDefinition;
+      sharedDefinition.isInAllConfigurations = sharedDefinition.isInAllConfigurations || entry.second.configurations.empty();
+      sharedDefinition.configurations.insert(std::begin(entry.second.configurations), std::end(entry.second.configurations));
+    }
+  }
+  
+  for (const auto& entry: sharedDefinitions) {
+    const auto& sharedDefinition = entry.second;
     
-    const auto interface = objType->getInterface();
-    
-    if (interface != nullptr) {
-      return std::string{interface->getName()} + "_FIXME_EXTRACT_PROTOCOL_AND_GENERIC_ARGUMENTS";
+    if (sharedDefinition.isInAllConfigurations) {
+      implStream << sharedDefinition.definition;
+      continue;
     }
     
-    assert(type->isObjCId() && "This type should be id!!!!");
+    const auto indexes = std::vector<size_t>{std::begin(sharedDefinition.configurations), std::end(sharedDefinition.configurations)};
     
-    return "id_FIXME_EXTRACT_PROTOCOL_ARGUMENTS";
+    implStream << llvm::formatv(objCConditionBeginFormat, formatConfigurationsCondition(configurations, indexes));
+    implStream << sharedDefinition.definition;
+    implStream << objCConditionEnd;
   }
   
-  auto generateCodeForInstanceMethod(CodeGeneratorContext& context, clang::ObjCPropertyDecl* propertyDecl, ProvidedItem item) -> void
-  {
-    const auto selectorName = item.value;
-    const auto type = getPropertyPointerType(propertyDecl);
-    const auto selectorInProperty = getInstanceSelectorForObjectType(type, selectorName);
-    assert(selectorInProperty != nullptr);
-    const auto selectorSignature = generateSelectorSignature(selectorInProperty);
-    context.headerStream << selectorSignature << ";\n\n";
-    const auto memberDef = llvm::formatv(objcInstanceSelectorForwardingFormat, propertyDecl->getName());
-    context.implStream << generateSelectorDefinition(selectorInProperty, selectorSignature, memberDef);
-  }
+  implStream << '\n';
   
-  auto generateCodeForClassMethod(CodeGeneratorContext& context, clang::ObjCPropertyDecl* propertyDecl, ProvidedItem item) -> void
-  {
-    const auto selectorName = item.value;
-    const auto type = getPropertyPointerType(propertyDecl);
-    const auto selectorInProperty = getClassSelectorForObjectType(type, selectorName);
-    assert(selectorInProperty != nullptr);
-    const auto selectorSignature = generateSelectorSignature(selectorInProperty);
-    context.headerStream << selectorSignature << ";\n\n";
-    const auto memberDef = llvm::formatv(objcClassSelectorForwardingFormat, formatObjectType(type->getObjectType()));
-    context.implStream << generateSelectorDefinition(selectorInProperty, selectorSignature, memberDef);
+  for (const auto& entry: categories) {
+    const auto& category = entry.second;
+    
+    // Empty when all its forwarders are shared
+    if (!category.implementation.empty()) {
+      const CategoryFragment fragment{implStream, offsets, category};
+      implStream << llvm::formatv(objCCategoryCommentFormat, category.hostName, category.typeName, category.propertyName);
+      implStream << category.implementation << '\n';
+    }
+    
+    auto& methods = hostMethods[category.hostName];
+    
+    for (const auto& lazyMethod: category.lazyMethods) {
+      (lazyMethod.isClassMethod ? methods.second : methods.first).push_back({&lazyMethod, &category});
+    }
   }
   
-  auto generateCodeForProperty(CodeGeneratorContext& context, clang::ObjCPropertyDecl* propertyDecl, ProvidedItem item) -> void
-  {
-    const auto memberPropertyName = item.value;
-    const auto type = getPropertyPointerType(propertyDecl);
+  // bsearch() compares with strcmp(), which orders the same as std::string
+  const auto writeTable = [&](llvm::StringRef tableName, std::vector<HostLazyMethod>& methods) {
+    std::stable_sort(std::begin(methods), std::end(methods), [](const HostLazyMethod& lhs, const HostLazyMethod& rhs) {
+      return lhs.method->selector < rhs.method->selector;
+    });
     
-    const auto propertyDeclInMember = [&]() -> clang::ObjCPropertyDecl* {
-      if (const auto instanceProperty = getInstancePropertyForObjectType(type, memberPropertyName)) {
-        return instanceProperty;
+    implStream << llvm::formatv(objCLazyMethodTableBeginFormat, tableName);
+    
+    for (const auto& entry: methods) {
+      const auto& method = *entry.method;
+      const CategoryFragment fragment{implStream, offsets, *entry.category};
+      
+      if (method.accessor.empty()) {
+        implStream << llvm::formatv(objCLazyMethodTableEntryFormat, method.selector, method.functionName, method.typeEncoding);
       }
+      else {
+        implStream << llvm::formatv(objCSharedLazyMethodTableEntryFormat, method.selector, method.functionName, method.accessor, method.typeEncoding);
+      }
+    }
     
-      return getClassPropertyForObjectType(type, memberPropertyName);
-    }();
+    implStream << objCLazyMethodTableEnd;
+  };
+  
+  for (auto& host: hostMethods) {
+    const auto instanceTableName = llvm::formatv(objCLazyMethodTableNameFormat, host.first, "instance").str();
+    const auto classTableName = llvm::formatv(objCLazyMethodTableNameFormat, host.first, "class").str();
     
-    assert(propertyDeclInMember != nullptr);
+    auto& instanceMethods = host.second.first;
+    auto& classMethods = host.second.second;
     
-    const auto locStart = propertyDeclInMember->getLocStart();
-    // FIXME: locEnd is pointing to the beginning of the property name :-(
-    const auto locEnd = propertyDeclInMember->getLocEnd();
+    if (instanceMethods.empty() && classMethods.empty()) {
+      continue;
+    }
     
-    const auto codeBegin = context.compilerInstance->getSourceManager().getCharacterData(locStart);
-    const auto codeEnd = context.compilerInstance->getSourceManager().getCharacterData(locEnd);
-    const auto propertySignature = llvm::StringRef(codeBegin, codeEnd - codeBegin);
+    if (!instanceMethods.empty()) {
+      writeTable(instanceTableName, instanceMethods);
+    }
     
-    llvm::outs() << "Property signature: " << propertySignature << '\n';
+    if (!classMethods.empty()) {
+      writeTable(classTableName, classMethods);
+    }
     
-    context.headerStream << propertySignature;
-    context.headerStream << propertyDeclInMember->getName() << ";\n\n";
+    implStream << llvm::formatv(objCLazyMethodResolverBeginFormat, host.first);
     
-    const auto f = [&]() -> std::string {
-      if (propertyDeclInMember->isInstanceProperty()) {
-        return llvm::formatv(objcInstanceSelectorForwardingFormat, propertyDeclInMember->getName());
-      }
-      
-      return llvm::formatv(objcClassSelectorForwardingFormat, formatObjectType(type->getObjectType()));
-    }();
+    if (!instanceMethods.empty()) {
+      implStream << llvm::formatv(objCLazyInstanceMethodResolverFormat, host.first, instanceTableName);
+    }
     
-    if (auto getterMethodDecl = propertyDeclInMember->getGetterMethodDecl()) {
-      const auto selectorSignature = generateSelectorSignature(getterMethodDecl);
-      context.implStream << generateSelectorDefinition(getterMethodDecl, selectorSignature, f);
+    if (!classMethods.empty()) {
+      implStream << llvm::formatv(objCLazyClassMethodResolverFormat, host.first, classTableName);
     }
     
-    if (auto setterMethodDecl = propertyDeclInMember->getSetterMethodDecl()) {
-      const auto selectorSignature = generateSelectorSignature(setterMethodDecl);
-      context.implStream << generateSelectorDefinition(setterMethodDecl, selectorSignature, f);
+    implStream << '\n' << objcDeclarationEnd;
+  }
+}
+
+// Members provided to the same host by more than one property are reported with both of them. In separate
+// categories the runtime silently keeps one of the forwarders, in a coalesced one they do not even compile.
+auto reportConflictingMembers(const std::map<std::string, std::vector<const GeneratedCategory*>>& hostCategories) -> bool
+{
+  auto hasConflicts = false;
+  
+  for (const auto& host: hostCategories) {
+    auto providers = std::map<std::string, const GeneratedCategory*>{};
+    
+    for (const auto category: host.second) {
+      for (const auto& selectorKey: category->selectorKeys) {
+        const auto provider = providers.emplace(selectorKey, category);
+        
+        if (provider.second) {
+          continue;
+        }
+        
+        const auto& previous = *provider.first->second;
+        
+        // Only one configuration is ever compiled, so categories generated by different ones never meet
+        const auto isInSameConfiguration = previous.configurations.empty()
+                                        || category->configurations.empty()
+                                        || std::find_first_of(std::begin(previous.configurations), std::end(previous.configurations),
+                                                              std::begin(category->configurations), std::end(category->configurations))
+                                           != std::end(previous.configurations);
+        
+        if (!isInSameConfiguration) {
+          continue;
+        }
+        
+        llvm::errs() << (coalesceCategories ? "error: " : "warning: ") << host.first << " gets " << selectorKey
+                     << " from both " << previous.propertyName << " (" << previous.typeName << ") and "
+                     << category->propertyName << " (" << category->typeName << ")\n";
+        
+        hasConflicts = true;
+      }
     }
   }
   
-  using ProvidedItemGenerator = std::add_pointer<void(CodeGeneratorContext&, clang::ObjCPropertyDecl*, ProvidedItem)>::type;
+  return hasConflicts;
+}
+
+// The output is written only once all the translation units are done, as any of them
+// might be the one generating a category from a header shared by many files.
+// Returns false if the generated code is known not to compile.
+auto writeGeneratedCode(const std::map<std::string, GeneratedCategory>& categories,
+                        const std::vector<Configuration>& configurations,
+                        GeneratedCodeOrigins& origins) -> bool
+{
+  std::error_code error;
   
-  const std::map<ProvidedItemType, ProvidedItemGenerator> generators {
-    {ProvidedItemType::InstanceMethod, generateCodeForInstanceMethod},
-    {ProvidedItemType::ClassMethod, generateCodeForClassMethod},
-    {ProvidedItemType::Property, generateCodeForProperty},
+  llvm::raw_fd_ostream headerStream{headerFilename, error, llvm::sys::fs::F_RW};
+  assert(!error && "You must pass -header-file command line argument");
+  
+  llvm::raw_fd_ostream implStream{implementationFilename, error, llvm::sys::fs::F_RW};
+  assert(!error && "You must pass -implementation-file command line argument");
+  
+  for (const auto& filePath: sourcePathList) {
+    headerStream << llvm::formatv(objCIncludeFileFormat, filePath);
+  }
+  
+  implStream << llvm::formatv(objCIncludeFileFormat, headerFilename.getValue());
+  
+  auto hostCategories = std::map<std::string, std::vector<const GeneratedCategory*>>{};
+  
+  for (const auto& entry: categories) {
+    hostCategories[entry.second.hostName].push_back(&entry.second);
+  }
+  
+  const auto hasConflicts = reportConflictingMembers(hostCategories);
+  
+  if (coalesceCategories) {
+    for (const auto& host: hostCategories) {
+      headerStream << llvm::formatv(objCCoalescedCategoryHeaderFormatBegin, host.first);
+      
+      for (const auto category: host.second) {
+        const CategoryFragment fragment{headerStream, origins.header, *category};
+        headerStream << llvm::formatv(objCCategoryCommentFormat, category->hostName, category->typeName, category->propertyName);
+        headerStream << category->header;
+      }
+      
+      headerStream << objcDeclarationEnd;
+      
+      if (lazyMethods) {
+        continue;
+      }
+      
+      implStream << llvm::formatv(objCCoalescedCategoryImplementationFormatBegin, host.first);
+      
+      for (const auto category: host.second) {
+        const CategoryFragment fragment{implStream, origins.implementation, *category};
+        implStream << llvm::formatv(objCCategoryCommentFormat, category->hostName, category->typeName, category->propertyName);
+        implStream << category->implementation << '\n';
+      }
+      
+      implStream << objcDeclarationEnd;
+    }
+  }
+  else {
+    for (const auto& entry: categories) {
+      const auto& category = entry.second;
+      
+      {
+        const CategoryFragment fragment{headerStream, origins.header, category};
+        headerStream << llvm::formatv(objCCategoryHeaderFormatBegin, category.hostName, category.typeName, category.propertyName);
+        headerStream << category.header << objcDeclarationEnd;
+      }
+      
+      // Lazy categories have no @implementation, their methods are added by the resolvers
+      if (!lazyMethods) {
+        const CategoryFragment fragment{implStream, origins.implementation, category};
+        implStream << llvm::formatv(objCCategoryImplementationFormatBegin, category.hostName, category.typeName, category.propertyName);
+        implStream << category.implementation << objcDeclarationEnd;
+      }
+    }
+  }
+  
+  if (lazyMethods) {
+    writeLazyMethods(implStream, categories, configurations, origins.implementation);
+  }
+  
+  return !(coalesceCategories && hasConflicts);
+}
+
+// Clang keeps one subdirectory per set of module-affecting flags in the cache, and
+// rebuilds a module whenever any of its headers, system ones included, changes
+auto getModuleArguments() -> clang::tooling::CommandLineArguments
+{
+  if (moduleCachePath.empty()) {
+    return {};
+  }
+  
+  return {
+    "-fmodules",
+    "-fmodules-validate-system-headers",
+    llvm::formatv(moduleCachePathArgumentFormat, moduleCachePath.getValue()),
   };
- 
-  // FIXME: no needs to say this function is way too large, doing too much and with a lot of copy&paste, right?
-  auto generateExtension(clang::ObjCPropertyDecl* o,
-                         CodeGeneratorContext& context,
-                         const std::vector<clang::AnnotateAttr*>& attrs,
-                         const KnownDeclarations& knownDeclarations) -> void
-  {
-    const auto providedItems = extractProvidedItems(attrs);
+}
 
-    if (providedItems.empty()) {
-      return;
-    }
-    
-    const auto parent = getParent(context, o);
-    
-    assert(parent != nullptr);
-    
-    const auto interfaceDecl = llvm::dyn_cast<clang::ObjCInterfaceDecl>(parent);
-    
-    assert(interfaceDecl != nullptr);
+// Errors in the generated files are reported at the PROVIDE annotation of the category they are in
+struct GeneratedCodeDiagnosticConsumer: public clang::DiagnosticConsumer
+{
+  const GeneratedCodeOrigins& _origins;
+  std::string _headerPath;
+  std::string _implementationPath;
+  
+  GeneratedCodeDiagnosticConsumer(const GeneratedCodeOrigins& origins, llvm::StringRef headerPath, llvm::StringRef implementationPath):
+  _origins(origins),
+  _headerPath(headerPath),
+  _implementationPath(implementationPath)
+  {
+  }
+  
+  auto HandleDiagnostic(clang::DiagnosticsEngine::Level level, const clang::Diagnostic& info) -> void final
+  {
+    clang::DiagnosticConsumer::HandleDiagnostic(level, info);
     
-    for (const auto& attr: attrs) {
-      const auto annotationValue = attr->getAnnotation();
-      llvm::outs() << "Found a property annotation!!! " << annotationValue << '\n';
-      o->dump();
+    if (level < clang::DiagnosticsEngine::Error) {
+      return;
     }
     
-    const auto propertyType = getPropertyPointerType(o);
-    
-    assert(propertyType != nullptr);
+    auto message = llvm::SmallString<256>{};
+    info.FormatDiagnostic(message);
     
-    const auto formattedInterfaceName = formatObjectType(propertyType->getObjectType());
+    if (!info.hasSourceManager() || info.getLocation().isInvalid()) {
+      llvm::errs() << "error: " << message << '\n';
+      return;
+    }
     
-    context.headerStream << llvm::formatv(objCCategoryHeaderFormatBegin,
-                                              interfaceDecl->getName(),
-                                              formattedInterfaceName,
-                                              o->getName());
+    const auto& sourceManager = info.getSourceManager();
+    const auto location = sourceManager.getFileLoc(info.getLocation());
+    const auto formattedLocation = formatLocation(sourceManager, location);
+    const auto presumedLocation = sourceManager.getPresumedLoc(location);
     
-    context.implStream << llvm::formatv(objCCategoryImplementationFormatBegin,
-                                                      interfaceDecl->getName(),
-                                                      formattedInterfaceName,
-                                                      o->getName());
+    const auto category = [&]() -> const GeneratedCategory* {
+      const auto offset = sourceManager.getFileOffset(location);
+      
+      if (llvm::sys::fs::equivalent(presumedLocation.getFilename(), _headerPath)) {
+        return GeneratedCodeOrigins::find(_origins.header, offset);
+      }
+      
+      if (llvm::sys::fs::equivalent(presumedLocation.getFilename(), _implementationPath)) {
+        return GeneratedCodeOrigins::find(_origins.implementation, offset);
+      }
+      
+      return nullptr;
+    }();
     
-    for (const auto item: providedItems) {
-      assert(item.type != ProvidedItemType::Unknown && "FIXME: handle error");
-      const auto generator = generators.at(item.type);
-      llvm::outs() << "Processing item: " << item.value << '\n';
-      generator(context, o, item);
+    if (category == nullptr) {
+      llvm::errs() << formattedLocation << ": error: " << message << '\n';
+      return;
     }
     
-    context.headerStream << objcDeclarationEnd;
-    context.implStream << objcDeclarationEnd;
+    llvm::errs() << category->origin << ": error: " << message << " (in the code generated for "
+                 << category->hostName << " (" << category->typeName << "__" << category->propertyName << ") at "
+                 << formattedLocation << ")\n";
   }
-}
+};
 
-struct ObjCVisitor: public clang::RecursiveASTVisitor<ObjCVisitor>
+// Files validateGeneratedCode() works with, made absolute once, as the working directory changes while validating
+struct ValidationPaths
 {
-  CodeGeneratorContext _context;
-  KnownDeclarations& _knownDeclarations;
+  std::string header;
+  std::string implementation;
+  // Whose compile command is used for the generated code
+  std::string source;
+};
 
-  template<typename F, typename D>
-  auto visit(F function, D decl) const -> bool
-  {
-    return ::runIfInMainFile(_context.compilerInstance->getASTContext(), function, decl);
-  }
+auto getValidationPaths() -> ValidationPaths
+{
+  const auto makeAbsolute = [](llvm::StringRef path) -> std::string {
+    auto absolutePath = llvm::SmallString<256>{path};
+    llvm::sys::fs::make_absolute(absolutePath);
+    return absolutePath.str();
+  };
   
-  ObjCVisitor(CodeGeneratorContext context,
-              KnownDeclarations& knownDeclarations):
-  _context(context),
-  _knownDeclarations(knownDeclarations)
-  {
-  }
+  return {makeAbsolute(headerFilename), makeAbsolute(implementationFilename), makeAbsolute(sourcePathList.front())};
+}
 
-  auto VisitObjCInterfaceDecl(clang::ObjCInterfaceDecl* o) -> bool
-  {
-    //llvm::outs() << "New interface: " << o->getName() << '\n';
-    //o->getLocation().print(llvm::outs(), _context.compilerInstance->getSourceManager());
-    
-    visit([](clang::ObjCInterfaceDecl* o) {
-      return true;
-    }, o);
-    
-    _knownDeclarations.interfaces[o->getName()] = o;
+// Parses the generated implementation, and so the header, as the first source file is compiled in the
+// configuration, sharing the files already loaded by the tool which generated them
+auto validateGeneratedCode(const clang::tooling::CompilationDatabase& compilations,
+                           const Configuration& configuration,
+                           const ValidationPaths& paths,
+                           clang::FileManager& files,
+                           const GeneratedCodeOrigins& origins) -> bool
+{
+  const auto& headerPath = paths.header;
+  const auto& implementationPath = paths.implementation;
+  const auto& sourcePath = paths.source;
+  
+  const auto commands = compilations.getCompileCommands(sourcePath);
+  
+  if (commands.empty()) {
+    llvm::errs() << "warning: no compile command for " << sourcePath << ", the generated code is not validated\n";
     return true;
   }
   
-  auto VisitObjCProtocolDecl(clang::ObjCProtocolDecl* o) -> bool
-  {
-    return true;
+  const auto& command = commands.front();
+  auto commandLine = command.CommandLine;
+  
+  for (auto& argument: commandLine) {
+    if (isSameFile(command, argument, sourcePath)) {
+      argument = implementationPath;
+    }
   }
   
-  auto VisitObjCMethodDecl(clang::ObjCMethodDecl* s) -> bool
-  {
-    //llvm::outs() << "Analysing selector " << s->getSelector().getAsString() << '\n';
-
-   return true;
+  commandLine = clang::tooling::getClangStripOutputAdjuster()(commandLine, implementationPath);
+  commandLine = clang::tooling::getClangSyntaxOnlyAdjuster()(commandLine, implementationPath);
+  
+  for (const auto& arguments: {getModuleArguments(), configuration.arguments}) {
+    commandLine = clang::tooling::getInsertArgumentAdjuster(arguments, clang::tooling::ArgumentInsertPosition::END)(commandLine, implementationPath);
   }
-    
-  auto VisitObjCCategoryDecl(clang::ObjCCategoryDecl* o) -> bool
-  {
-    const auto interface = o->getClassInterface();
-    //llvm::outs() << "LALALA category decl: " << o->getName() << " for interface: " << interface->getName() << '\n';
-    return true;
+  
+  // Read again, as the files loaded by the tool might have had an older version of the generated header
+  const auto header = llvm::MemoryBuffer::getFile(headerPath);
+  const auto implementation = llvm::MemoryBuffer::getFile(implementationPath);
+  
+  if (!header || !implementation) {
+    llvm::errs() << "error: cannot read the generated code back\n";
+    return false;
   }
- 
-  auto VisitObjCImplementationDecl(clang::ObjCImplementationDecl* o) -> bool
-  {
-    // FIXME: do we really need to visit implementations of classes?
-    return visit([](clang::ObjCImplementationDecl *o) {
-        llvm::outs() << "visiting impl decl " << o->getName() << '\n';
-        return true;
-    }, o);
+  
+  // Relative paths of the command are relative to its directory, as when the tool ran it
+  auto initialDirectory = llvm::SmallString<256>{};
+  llvm::sys::fs::current_path(initialDirectory);
+  llvm::sys::fs::set_current_path(command.Directory);
+  
+  GeneratedCodeDiagnosticConsumer diagnosticConsumer{origins, headerPath, implementationPath};
+  
+  clang::tooling::ToolInvocation invocation{commandLine, new clang::SyntaxOnlyAction, &files};
+  invocation.mapVirtualFile(headerPath, (*header)->getBuffer());
+  invocation.mapVirtualFile(implementationPath, (*implementation)->getBuffer());
+  invocation.setDiagnosticConsumer(&diagnosticConsumer);
+  
+  const auto isValid = invocation.run() && diagnosticConsumer.getNumErrors() == 0;
+  
+  llvm::sys::fs::set_current_path(initialDirectory);
+  
+  llvm::outs() << "Validated the generated code" << (configuration.condition.empty() ? "" : " for " + configuration.condition) << ": "
+               << diagnosticConsumer.getNumErrors() << " errors\n";
+  
+  return isValid;
+}
+
+auto main(int argc, const char **argv) -> int
+{
+  auto op = clang::tooling::CommonOptionsParser(argc, argv, commandLineCategory);
+  
+  sourcePathList = op.getSourcePathList();
+  
+  if (shareForwarders && !lazyMethods) {
+    llvm::errs() << "error: -share-forwarders only works along with -lazy-methods\n";
+    return 1;
   }
   
-  auto VisitObjCIvarDecl(clang::ObjCIvarDecl* o) -> bool
-  {
-    // TODO: do the same logic as for properties
-    return visit([](clang::ObjCIvarDecl*) {
-        //llvm::outs() << "visiting ivar decl " << o->getName() << '\n';
-        return true;
-    }, o);
+  // Paths are matched against the base directory as a prefix, so it has to look like them
+  if (!cacheBaseDirectory.empty()) {
+    auto baseDirectory = llvm::SmallString<256>{cacheBaseDirectory};
+    llvm::sys::fs::make_absolute(baseDirectory);
+    llvm::sys::path::remove_dots(baseDirectory, true);
+  
+    cacheBaseDirectory = llvm::StringRef{baseDirectory}.rtrim("/").str();
   }
- 
-  auto VisitObjCPropertyDecl(clang::ObjCPropertyDecl* o) -> bool
-  {
-    //llvm::outs() << "Visiting property " << o->getName() << '\n';
+  
+  auto toolSourcePathList = std::vector<std::string>{};
+  
+  const auto umbrellas = [&]() -> std::vector<UmbrellaTranslationUnit> {
+    if (!umbrellaParse) {
+      toolSourcePathList = sourcePathList;
+      return {};
+    }
     
-    return visit([this](clang::ObjCPropertyDecl *o) {
-      const auto typeInfo = o->getTypeSourceInfo();
-      const auto type = typeInfo->getType().getTypePtrOrNull();
+    return groupInUmbrellas(op.getCompilations(), sourcePathList, toolSourcePathList);
+  }();
+  
+  for (const auto& umbrella: umbrellas) {
+    toolSourcePathList.push_back(umbrella.path);
+  }
+  
+  const UmbrellaCompilationDatabase compilations{op.getCompilations(), umbrellas};
+  
+  const auto prepareTool = [&](clang::tooling::ClangTool& tool) {
+    for (const auto& umbrella: umbrellas) {
+      tool.mapVirtualFile(umbrella.path, umbrella.contents);
+    }
     
-      auto objcObjectType = llvm::dyn_cast<clang::ObjCObjectPointerType>(type);
+    const auto moduleArguments = getModuleArguments();
     
-      // Only properties of objc types can provide...
-      // TODO: emit error in case properties of other types try to provide something
-      if (objcObjectType == nullptr) {
-        return true;
-      }
+    if (!moduleArguments.empty()) {
+      tool.appendArgumentsAdjuster(clang::tooling::getInsertArgumentAdjuster(moduleArguments, clang::tooling::ArgumentInsertPosition::END));
+    }
+  };
+  
+  const auto configurations = [&]() -> std::vector<Configuration> {
+    if (configurationList.empty()) {
+      return {Configuration{}};
+    }
+    
+    auto configurations = std::vector<Configuration>{};
+    
+    for (const auto& value: configurationList) {
+      auto configuration = Configuration{};
       
-      //llvm::outs() << "Found a object property!!! " << objcObjectType->getTypeClassName()
-      //             << ":" << o->getName() << '\n';
-
-      auto provideAnnotationAttrs = std::vector<clang::AnnotateAttr*>{};
-
-      // I know, I know, but copy_if does not cast, so a simple for does the job
-      for (auto& attr: o->getAttrs()) {
-        auto annotateAttr = llvm::dyn_cast<clang::AnnotateAttr>(attr);
-
-        if (annotateAttr != nullptr && annotateAttr->getAnnotation().startswith(PROVIDE_TAG)) {
-          provideAnnotationAttrs.push_back(annotateAttr);
-        }
+      if (parseConfiguration(value, configuration)) {
+        configurations.push_back(std::move(configuration));
       }
+    }
+    
+    return configurations;
+  }();
+  
+  if (configurations.size() != std::max<size_t>(configurationList.size(), 1)) {
+    return 1;
+  }
+  
+  const auto addConfigurationArguments = [](clang::tooling::ClangTool& tool, const Configuration& configuration) {
+    if (!configuration.arguments.empty()) {
+      tool.appendArgumentsAdjuster(clang::tooling::getInsertArgumentAdjuster(configuration.arguments, clang::tooling::ArgumentInsertPosition::END));
+    }
+  };
+  
+  // An umbrella can have errors its files do not have on their own, e.g. static functions with the same name in
+  // two of them, so what it generated is discarded and its files are parsed one by one
+  const auto runTool = [&](clang::tooling::ClangTool& tool, const Configuration& configuration, clang::tooling::FrontendActionFactory* factory) -> int {
+    translationUnitsWithErrors.clear();
+    
+    const auto result = tool.run(factory);
+    
+    auto fallbackSourcePathList = std::vector<std::string>{};
+    auto hasOtherErrors = false;
+    
+    for (const auto& translationUnit: translationUnitsWithErrors) {
+      const auto umbrella = std::find_if(std::begin(umbrellas), std::end(umbrellas), [&](const UmbrellaTranslationUnit& umbrella) {
+        return umbrella.path == translationUnit;
+      });
       
-      if (provideAnnotationAttrs.empty()) {
-        return true;
+      if (umbrella == std::end(umbrellas)) {
+        hasOtherErrors = true;
+        continue;
       }
       
-      generateExtension(o, _context, provideAnnotationAttrs, _knownDeclarations);
+      llvm::outs() << "Umbrella " << umbrella->path << " has errors, parsing its " << umbrella->files.size() << " files one by one\n";
       
-      return true;
-    }, o);
-  }
-};
-
-struct ObjCASTConsumer: public clang::ASTConsumer
-{
-  KnownDeclarations _knownDeclarations;
-  ObjCVisitor _visitor;
-
-  ObjCASTConsumer(CodeGeneratorContext& context):
-  _visitor({context, _knownDeclarations})
-  {
-  }
-
-  auto HandleTopLevelDecl(clang::DeclGroupRef declGroup) -> bool final
-  {
-    for (auto &b: declGroup) {
-      _visitor.TraverseDecl(b);
+      generatedCategories.discard(umbrella->path);
+      fallbackSourcePathList.insert(fallbackSourcePathList.end(), umbrella->files.begin(), umbrella->files.end());
     }
     
-    return true;
-  }
-
-};
-
-namespace {
-  llvm::cl::OptionCategory commandLineCategory{"Mixin With Steroids Options"};
-  
-  llvm::cl::opt<std::string> headerFilename{"header-file",
-    llvm::cl::desc("Generated header file"),
-    llvm::cl::cat(commandLineCategory)};
+    if (fallbackSourcePathList.empty()) {
+      return result;
+    }
     
-  llvm::cl::opt<std::string> implementationFilename{"implementation-file",
-    llvm::cl::desc("Generated implementation file"),
-    llvm::cl::cat(commandLineCategory)};
+    auto fallbackTool = clang::tooling::ClangTool(compilations, fallbackSourcePathList);
+    prepareTool(fallbackTool);
+    addConfigurationArguments(fallbackTool, configuration);
     
-  // FIXME: this is a huge workaround for not being able to get all the files passed on the command line
-  std::vector<std::string> sourcePathList;
-  bool isFirstParse = true;
-}
-
-// For each source file provided to the tool, a new FrontendAction is created.
-struct MyFrontendAction: public clang::ASTFrontendAction
-{
-  std::unique_ptr<llvm::raw_fd_ostream> _headerStream;
-  std::unique_ptr<llvm::raw_fd_ostream> _implStream;
-  
-  std::unique_ptr<CodeGeneratorContext> _codeGeneratorContext;
+    const auto fallbackResult = fallbackTool.run(factory);
+    
+    return hasOtherErrors ? result : fallbackResult;
+  };
   
-  MyFrontendAction()
-  {
+  // A forwarder called by any configuration is kept in all of them
+  if (stripUnusedForwarders) {
+    auto usageSources = toolSourcePathList;
+    usageSources.insert(usageSources.end(), usageSourceList.begin(), usageSourceList.end());
+    
+    for (const auto& configuration: configurations) {
+      auto usageTool = clang::tooling::ClangTool(compilations, usageSources);
+      prepareTool(usageTool);
+      addConfigurationArguments(usageTool, configuration);
+      
+      if (const auto result = runTool(usageTool, configuration, clang::tooling::newFrontendActionFactory<SelectorUsageFrontendAction>().get())) {
+        return result;
+      }
+    }
   }
   
-  virtual ~MyFrontendAction()
-  {
+  auto cache = std::unique_ptr<OutputCache>{};
+  
+  if (!cacheDirectory.empty()) {
+    cache = llvm::make_unique<OutputCache>(cacheDirectory, cacheBaseDirectory);
   }
   
-  auto BeginSourceFileAction(clang::CompilerInstance &compilerInstance, llvm::StringRef file) -> bool final
-  {
-    std::error_code error;
+  // Only worth finding out when something is keyed by it
+  const auto toolIdentity = (cache || !incrementalManifestPath.empty()) ? getToolIdentity(argv[0], cache.get()) : std::string{};
+  const auto toolBaseKey = std::string{cacheFormatVersion} + '\0' + toolIdentity + '\0' + getOutputOptionsKey();
+  
+  // The tool of each configuration, whose files are reused when validating its output
+  auto tools = std::vector<std::unique_ptr<clang::tooling::ClangTool>>{};
+  
+  // Configurations share the tool, its module cache and output cache, and the categories they all generate the same
+  const auto generateConfiguration = [&](const Configuration& configuration, size_t index) -> int {
+    auto baseKey = toolBaseKey;
     
-    _headerStream = std::make_unique<llvm::raw_fd_ostream>(headerFilename, error, llvm::sys::fs::F_RW);
-    assert(!error && "You must pass -header-file command line argument");
+    for (const auto& argument: configuration.arguments) {
+      baseKey += '\0' + argument;
+    }
+    
+    const auto manifestPath = configurationList.empty() ? incrementalManifestPath.getValue()
+                                                        : llvm::formatv("{0}.{1}", incrementalManifestPath.getValue(), index).str();
+    
+    generatedCategories.clear();
+    previousManifest = IncrementalManifest{};
+    
+    if (!incrementalManifestPath.empty()) {
+      previousManifest.load(manifestPath, baseKey);
+    }
+    
+    // Absolute path of each translation unit, to the key of what it generates
+    auto translationUnitKeys = std::map<std::string, std::string>{};
+    auto cacheMisses = std::set<std::string>{};
+    auto changedSourcePathList = toolSourcePathList;
+    
+    if (cache || !incrementalManifestPath.empty()) {
+      changedSourcePathList.clear();
+      
+      for (const auto& sourcePath: toolSourcePathList) {
+        auto file = llvm::SmallString<256>{sourcePath};
+        llvm::sys::fs::make_absolute(file);
+        
+        const auto umbrella = std::find_if(std::begin(umbrellas), std::end(umbrellas), [&](const UmbrellaTranslationUnit& umbrella) {
+          return umbrella.path == file.str();
+        });
+        
+        const auto contents = llvm::MemoryBuffer::getFile(file);
+        
+        if (umbrella == std::end(umbrellas) && !contents) {
+          changedSourcePathList.push_back(sourcePath);
+          continue;
+        }
+        
+        const auto mainFileContents = (umbrella != std::end(umbrellas)) ? llvm::StringRef{umbrella->contents} : (*contents)->getBuffer();
+        const auto key = computeTranslationUnitKey(baseKey, compilations.getCompileCommands(file), mainFileContents, cacheBaseDirectory);
+        
+        translationUnitKeys[file.str()] = key;
+        
+        if (previousManifest.splice(file.str(), key, generatedCategories)) {
+          llvm::outs() << "Nothing changed for " << sourcePath << ", reusing what it generated\n";
+          continue;
+        }
+        
+        if (cache && cache->lookup(key, file.str(), generatedCategories)) {
+          continue;
+        }
+        
+        cacheMisses.insert(file.str());
+        changedSourcePathList.push_back(sourcePath);
+      }
+    }
     
-    _implStream = std::make_unique<llvm::raw_fd_ostream>(implementationFilename, error, llvm::sys::fs::F_RW);
-    assert(!error && "You must pass -implementation-file command line argument");
+    tools.push_back(llvm::make_unique<clang::tooling::ClangTool>(compilations, changedSourcePathList));
+    auto& tool = *tools.back();
+    prepareTool(tool);
+    addConfigurationArguments(tool, configuration);
     
-    _codeGeneratorContext = std::make_unique<CodeGeneratorContext>(&compilerInstance, file, *_headerStream.get(), *_implStream.get());
+    const auto result = changedSourcePathList.empty() ? 0 : runTool(tool, configuration, clang::tooling::newFrontendActionFactory<MyFrontendAction>().get());
     
-    if (isFirstParse) {
-      isFirstParse = false;
-      for (const auto& filePath: sourcePathList) {
-        *_headerStream.get() << llvm::formatv(objCIncludeFileFormat, filePath);
+    if (cache) {
+      for (const auto& miss: cacheMisses) {
+        const auto record = generatedCategories.translationUnits.find(miss);
+        
+        if (record != generatedCategories.translationUnits.end()) {
+          cache->store(translationUnitKeys.at(miss), record->second, generatedCategories);
+        }
       }
     }
     
-    *_implStream.get() << llvm::formatv(objCIncludeFileFormat, headerFilename.getValue());
+    if (!incrementalManifestPath.empty()) {
+      IncrementalManifest::save(manifestPath, baseKey, translationUnitKeys, generatedCategories);
+    }
     
-    return true;
-  }
+    return result;
+  };
   
-  auto CreateASTConsumer(clang::CompilerInstance&, llvm::StringRef) -> std::unique_ptr<clang::ASTConsumer> final
-  {
-    assert(_codeGeneratorContext);
-    return llvm::make_unique<ObjCASTConsumer>(*_codeGeneratorContext.get());
+  auto configurationCategories = std::vector<std::map<std::string, GeneratedCategory>>{};
+  auto result = 0;
+  
+  for (auto i = size_t{}; i < configurations.size(); i++) {
+    if (!configurations[i].condition.empty()) {
+      llvm::outs() << "Generating for configuration " << configurations[i].condition << '\n';
+    }
+    
+    if (const auto configurationResult = generateConfiguration(configurations[i], i)) {
+      result = configurationResult;
+    }
+    
+    configurationCategories.push_back(std::move(generatedCategories.categories));
   }
   
-  auto EndSourceFileAction() -> void final
-  {
+  if (cache) {
+    cache->evict(uint64_t{cacheMaxSize.getValue()} * 1024 * 1024);
+    
+    llvm::outs() << "Cache: " << cache->hits << " hits, " << cache->misses << " misses\n";
   }
-};
-
-auto main(int argc, const char **argv) -> int
-{
-  auto op = clang::tooling::CommonOptionsParser(argc, argv, commandLineCategory);
   
-  sourcePathList = op.getSourcePathList();
+  const auto categories = mergeConfigurations(configurations, configurationCategories);
+  
+  auto origins = GeneratedCodeOrigins{};
+  auto isOutputValid = writeGeneratedCode(categories, configurations, origins);
   
-  auto tool = clang::tooling::ClangTool(op.getCompilations(), sourcePathList);
+  if (validateOutput && isOutputValid && !sourcePathList.empty()) {
+    const auto validationPaths = getValidationPaths();
+    
+    for (auto i = size_t{}; i < configurations.size(); i++) {
+      isOutputValid = validateGeneratedCode(compilations, configurations[i], validationPaths, tools[i]->getFiles(), origins) && isOutputValid;
+    }
+  }
   
-  return tool.run(clang::tooling::newFrontendActionFactory<MyFrontendAction>().get());
+  return result != 0 ? result : !isOutputValid;
 }
-